@@ -0,0 +1,505 @@
+#ifndef BVH_H
+#define BVH_H
+
+#include <vector>
+#include <algorithm>
+#include <numeric>
+#include <cmath>
+#include <atomic>
+#include <vecmath.h>
+#include "ray.hpp"
+
+struct AABB		// Axis-aligned box on plain floats, the traversal loops avoid the out-of-line Vector3f operators
+{
+	float min[3] = {INFINITY, INFINITY, INFINITY};
+	float max[3] = {-INFINITY, -INFINITY, -INFINITY};
+
+	void Expand(const Vector3f& p)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			this->min[i] = std::min(this->min[i], p[i]);
+			this->max[i] = std::max(this->max[i], p[i]);
+		}
+	}
+
+	void Expand(const AABB& box)
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			this->min[i] = std::min(this->min[i], box.min[i]);
+			this->max[i] = std::max(this->max[i], box.max[i]);
+		}
+	}
+
+	bool Empty() const { return this->min[0] > this->max[0]; }
+	float Center(int axis) const { return 0.5f * (this->min[axis] + this->max[axis]); }
+
+	float Area() const
+	{
+		if (this->Empty())
+			return 0.0f;
+		float dx = this->max[0] - this->min[0], dy = this->max[1] - this->min[1], dz = this->max[2] - this->min[2];
+		return 2.0f * (dx * dy + dy * dz + dz * dx);
+	}
+
+	// Slab test of the ray segment [0, tmax], inv holds the reciprocals of the ray direction
+	bool Intersect(const float origin[3], const float inv[3], float tmax) const
+	{
+		float t0 = 0.0f, t1 = tmax;
+		for (int i = 0; i < 3; i++)
+		{
+			float tNear = (this->min[i] - origin[i]) * inv[i];
+			float tFar = (this->max[i] - origin[i]) * inv[i];
+			if (tNear > tFar)
+				std::swap(tNear, tFar);
+			t0 = (tNear > t0)? tNear : t0;
+			t1 = (tFar * 1.0000004f < t1)? tFar * 1.0000004f : t1;	// Slack for the rounding of the slab distances
+			if (t0 > t1)
+				return false;
+		}
+		return true;
+	}
+};
+
+// Bounding volume hierarchy over primitives given by their boxes, built with binned SAH or along a
+// Morton curve and stored in one array. The two children of an interior node are adjacent and come
+// after it, subtrees built by a single task are laid out depth-first
+class BVHTree
+{
+public:
+	struct Node		// 32 bytes
+	{
+		AABB box;
+		int offset;				// First primitive of a leaf, first of the two children of an interior node
+		unsigned short count;	// Primitives of a leaf, 0 for interior nodes
+		unsigned char axis;		// Split axis, the first child holds the lower centroids
+		unsigned char pad;
+	};
+
+private:
+	std::vector<Node> Nodes;
+	std::vector<int> PrimIdx;			// Leaf order -> primitive index
+	std::vector<float> Centroid;		// 3 floats per primitive, only used during the build
+	std::vector<unsigned> Codes;		// Morton code per leaf order position, only used during BuildLBVH()
+	static const int nBins = 16;
+	static const int MaxLeafSize = 8;	// A leaf is only made when SAH prefers it below this size
+	static const int LBVHLeafSize = 4;	// Morton ranges at or below this size become leaves
+	static const int MaxDepth = 48;		// Deeper splits fall back to the median to bound the stack
+	static const int StackSize = 128;
+	static const int TaskSize = 4096;	// Subtrees below this many primitives are built by one task
+	static const int ChunkSize = 16384;	// Larger nodes compute their bounds and bins in parallel chunks
+
+	int BinOf(int prim, int axis, float lo, float scale) const
+	{
+		return std::min(nBins - 1, (int)((this->Centroid[3 * prim + axis] - lo) * scale));
+	}
+
+	void ComputeBounds(const std::vector<AABB>& bounds, int begin, int end, AABB& box, AABB& CentroidBox) const
+	{
+		for (int i = begin; i < end; i++)
+		{
+			box.Expand(bounds[this->PrimIdx[i]]);
+			const float* c = &this->Centroid[3 * this->PrimIdx[i]];
+			for (int j = 0; j < 3; j++)
+			{
+				CentroidBox.min[j] = std::min(CentroidBox.min[j], c[j]);
+				CentroidBox.max[j] = std::max(CentroidBox.max[j], c[j]);
+			}
+		}
+	}
+
+	void ComputeBins(const std::vector<AABB>& bounds, int begin, int end, int axis, float lo, float scale, int* BinCount, AABB* BinBox) const
+	{
+		for (int i = begin; i < end; i++)
+		{
+			int b = this->BinOf(this->PrimIdx[i], axis, lo, scale);
+			BinCount[b]++;
+			BinBox[b].Expand(bounds[this->PrimIdx[i]]);
+		}
+	}
+
+	// Fill the box of the node over PrimIdx[begin, end) and partition the range, returns the split
+	// position or -1 after making the node a leaf
+	int Split(const std::vector<AABB>& bounds, Node& node, int begin, int end, int depth)
+	{
+		int n = end - begin;
+		int nChunks = (n + ChunkSize - 1) / ChunkSize;
+		AABB box, CentroidBox;
+		if (nChunks > 1)
+		{
+			std::vector<AABB> ChunkBox(nChunks), ChunkCentroid(nChunks);
+			#pragma omp taskloop shared(bounds, ChunkBox, ChunkCentroid)
+			for (int c = 0; c < nChunks; c++)
+				this->ComputeBounds(bounds, begin + c * ChunkSize, std::min(end, begin + (c + 1) * ChunkSize), ChunkBox[c], ChunkCentroid[c]);
+			for (int c = 0; c < nChunks; c++)
+			{
+				box.Expand(ChunkBox[c]);
+				CentroidBox.Expand(ChunkCentroid[c]);
+			}
+		}
+		else
+			this->ComputeBounds(bounds, begin, end, box, CentroidBox);
+		node.box = box;
+
+		int axis = 0;
+		for (int j = 1; j < 3; j++)
+			if (CentroidBox.max[j] - CentroidBox.min[j] > CentroidBox.max[axis] - CentroidBox.min[axis])
+				axis = j;
+		float lo = CentroidBox.min[axis], extent = CentroidBox.max[axis] - lo;
+		if (n == 1 || (extent <= 0.0f && n <= 0xffff))
+			return this->MakeLeaf(node, begin, n);
+
+		int mid = begin;
+		if (extent > 0.0f && depth < this->MaxDepth)
+		{
+			// Bin the centroids and sweep the split planes between the bins
+			int BinCount[nBins] = {};
+			AABB BinBox[nBins];
+			float scale = nBins / extent;
+			if (nChunks > 1)
+			{
+				std::vector<int> ChunkCount(nChunks * nBins, 0);
+				std::vector<AABB> ChunkBox(nChunks * nBins);
+				#pragma omp taskloop shared(bounds, ChunkCount, ChunkBox)
+				for (int c = 0; c < nChunks; c++)
+					this->ComputeBins(bounds, begin + c * ChunkSize, std::min(end, begin + (c + 1) * ChunkSize), axis, lo, scale, &ChunkCount[c * nBins], &ChunkBox[c * nBins]);
+				for (int c = 0; c < nChunks; c++)
+					for (int b = 0; b < nBins; b++)
+					{
+						BinCount[b] += ChunkCount[c * nBins + b];
+						BinBox[b].Expand(ChunkBox[c * nBins + b]);
+					}
+			}
+			else
+				this->ComputeBins(bounds, begin, end, axis, lo, scale, BinCount, BinBox);
+
+			float RightArea[nBins];
+			int RightCount[nBins];
+			AABB acc;
+			int cnt = 0;
+			for (int b = nBins - 1; b > 0; b--)
+			{
+				acc.Expand(BinBox[b]);
+				cnt += BinCount[b];
+				RightArea[b] = acc.Area();
+				RightCount[b] = cnt;
+			}
+			float BestCost = INFINITY;
+			int BestSplit = -1;
+			acc = AABB();
+			cnt = 0;
+			for (int b = 0; b < nBins - 1; b++)
+			{
+				acc.Expand(BinBox[b]);
+				cnt += BinCount[b];
+				if (cnt == 0 || RightCount[b + 1] == 0)
+					continue;
+				float cost = cnt * acc.Area() + RightCount[b + 1] * RightArea[b + 1];
+				if (cost < BestCost)
+				{
+					BestCost = cost;
+					BestSplit = b;
+				}
+			}
+			// A traversal step costs an eighth of a primitive test
+			float area = box.Area();
+			float SplitCost = (BestSplit >= 0 && area > 0.0f)? 0.125f + BestCost / area : INFINITY;
+			if (n <= this->MaxLeafSize && (float)n <= SplitCost)
+				return this->MakeLeaf(node, begin, n);
+			if (BestSplit >= 0)
+				mid = std::partition(this->PrimIdx.begin() + begin, this->PrimIdx.begin() + end, [&](int prim) { return this->BinOf(prim, axis, lo, scale) <= BestSplit; }) - this->PrimIdx.begin();
+		}
+		if (mid == begin || mid == end)
+		{
+			mid = (begin + end) / 2;
+			std::nth_element(this->PrimIdx.begin() + begin, this->PrimIdx.begin() + mid, this->PrimIdx.begin() + end, [&](int a, int b) {
+				return this->Centroid[3 * a + axis] < this->Centroid[3 * b + axis];
+			});
+		}
+		node.count = 0;
+		node.axis = axis;
+		return mid;
+	}
+
+	int MakeLeaf(Node& node, int begin, int n)
+	{
+		node.offset = begin;
+		node.count = n;
+		node.axis = 0;
+		return -1;
+	}
+
+	static unsigned ExpandBits(unsigned x)		// Spread the low 10 bits of x to every third bit
+	{
+		x = (x * 0x00010001u) & 0xFF0000FFu;
+		x = (x * 0x00000101u) & 0x0F00F00Fu;
+		x = (x * 0x00000011u) & 0xC30C30C3u;
+		x = (x * 0x00000005u) & 0x49249249u;
+		return x;
+	}
+
+	// LSD radix sort of PrimIdx by Codes, both end up in leaf order
+	void SortCodes()
+	{
+		int n = this->PrimIdx.size();
+		std::vector<unsigned> codes(n);
+		std::vector<int> prims(n);
+		for (int shift = 0; shift < 32; shift += 8)
+		{
+			int offset[257] = {};
+			for (int i = 0; i < n; i++)
+				offset[((this->Codes[i] >> shift) & 0xff) + 1]++;
+			for (int b = 0; b < 256; b++)
+				offset[b + 1] += offset[b];
+			for (int i = 0; i < n; i++)
+			{
+				int dst = offset[(this->Codes[i] >> shift) & 0xff]++;
+				codes[dst] = this->Codes[i];
+				prims[dst] = this->PrimIdx[i];
+			}
+			this->Codes.swap(codes);
+			this->PrimIdx.swap(prims);
+		}
+	}
+
+	// Split at the highest bit in which the sorted codes of the range differ, runs of equal codes are
+	// halved. The boxes are left to Refit()
+	int SplitMorton(Node& node, int begin, int end)
+	{
+		int n = end - begin;
+		if (n <= this->LBVHLeafSize)
+			return this->MakeLeaf(node, begin, n);
+		node.count = 0;
+		node.axis = 0;
+		unsigned diff = this->Codes[begin] ^ this->Codes[end - 1];
+		if (diff == 0)
+			return begin + n / 2;
+		int bit = 31;
+		while ((diff >> bit) == 0)
+			bit--;
+		node.axis = 2 - bit % 3;
+		return std::partition_point(this->Codes.begin() + begin, this->Codes.begin() + end, [bit](unsigned code) { return ((code >> bit) & 1) == 0; }) - this->Codes.begin();
+	}
+
+	// Depth-first build of a subtree into out, the node at idx is already allocated. split(node, begin,
+	// end, depth) fills the node and returns the partition position, or -1 after making it a leaf
+	template <typename Splitter>
+	void BuildSerial(Splitter& split, std::vector<Node>& out, int idx, int begin, int end, int depth)
+	{
+		Node node;
+		int mid = split(node, begin, end, depth);
+		if (mid >= 0)
+		{
+			node.offset = out.size();
+			out.resize(out.size() + 2);
+		}
+		out[idx] = node;
+		if (mid < 0)
+			return;
+		this->BuildSerial(split, out, node.offset, begin, mid, depth + 1);
+		this->BuildSerial(split, out, node.offset + 1, mid, end, depth + 1);
+	}
+
+	// Build the subtree of Nodes[idx], sibling pairs are taken from NextNode. Small subtrees are
+	// built by one task into a local array and copied to a range reserved at once
+	template <typename Splitter>
+	void BuildTask(Splitter& split, std::atomic<int>& NextNode, int idx, int begin, int end, int depth)
+	{
+		if (end - begin <= TaskSize)
+		{
+			std::vector<Node> local(1);
+			local.reserve(2 * (end - begin));
+			this->BuildSerial(split, local, 0, begin, end, depth);
+			int base = NextNode.fetch_add(local.size() - 1) - 1;	// Local index k > 0 goes to base + k
+			for (size_t k = 0; k < local.size(); k++)
+			{
+				if (local[k].count == 0)
+					local[k].offset += base;
+				this->Nodes[k? base + k : idx] = local[k];
+			}
+			return;
+		}
+
+		Node node;
+		int mid = split(node, begin, end, depth);
+		if (mid >= 0)
+			node.offset = NextNode.fetch_add(2);
+		this->Nodes[idx] = node;
+		if (mid < 0)
+			return;
+		#pragma omp task shared(split, NextNode)
+		this->BuildTask(split, NextNode, node.offset, begin, mid, depth + 1);
+		this->BuildTask(split, NextNode, node.offset + 1, mid, end, depth + 1);
+	}
+
+public:
+	BVHTree() {}
+
+	void Build(const std::vector<AABB>& bounds)
+	{
+		int n = bounds.size();
+		this->Nodes.clear();
+		this->PrimIdx.resize(n);
+		std::iota(this->PrimIdx.begin(), this->PrimIdx.end(), 0);
+		if (n == 0)
+			return;
+		this->Centroid.resize(3 * n);
+		#pragma omp parallel for if (n > TaskSize)
+		for (int i = 0; i < n; i++)
+			for (int j = 0; j < 3; j++)
+				this->Centroid[3 * i + j] = bounds[i].Center(j);
+
+		this->Nodes.resize(2 * n - 1);
+		std::atomic<int> NextNode(1);
+		auto split = [&](Node& node, int begin, int end, int depth) { return this->Split(bounds, node, begin, end, depth); };
+		#pragma omp parallel if (n > TaskSize)
+		#pragma omp single
+		this->BuildTask(split, NextNode, 0, 0, n, 0);
+		this->Nodes.resize(NextNode.load());
+		std::vector<float>().swap(this->Centroid);
+	}
+
+	// Linear BVH over the primitives sorted along a Morton curve of their centroids. It builds in a
+	// fraction of the time of Build() with somewhat worse trees, meant for geometry changing every frame
+	void BuildLBVH(const std::vector<AABB>& bounds)
+	{
+		int n = bounds.size();
+		this->Nodes.clear();
+		this->PrimIdx.resize(n);
+		std::iota(this->PrimIdx.begin(), this->PrimIdx.end(), 0);
+		if (n == 0)
+			return;
+		AABB CentroidBox;
+		for (int i = 0; i < n; i++)
+			for (int j = 0; j < 3; j++)
+			{
+				CentroidBox.min[j] = std::min(CentroidBox.min[j], bounds[i].Center(j));
+				CentroidBox.max[j] = std::max(CentroidBox.max[j], bounds[i].Center(j));
+			}
+		float scale[3];
+		for (int j = 0; j < 3; j++)
+		{
+			float extent = CentroidBox.max[j] - CentroidBox.min[j];
+			scale[j] = (extent > 0.0f)? 1024.0f / extent : 0.0f;
+		}
+		this->Codes.resize(n);
+		#pragma omp parallel for if (n > TaskSize)
+		for (int i = 0; i < n; i++)
+		{
+			unsigned code = 0;
+			for (int j = 0; j < 3; j++)
+			{
+				unsigned q = (unsigned)std::min(1023.0f, (bounds[i].Center(j) - CentroidBox.min[j]) * scale[j]);
+				code |= ExpandBits(q) << (2 - j);
+			}
+			this->Codes[i] = code;
+		}
+		this->SortCodes();
+
+		this->Nodes.resize(2 * n - 1);
+		std::atomic<int> NextNode(1);
+		auto split = [this](Node& node, int begin, int end, int depth) { return this->SplitMorton(node, begin, end); };
+		#pragma omp parallel if (n > TaskSize)
+		#pragma omp single
+		this->BuildTask(split, NextNode, 0, 0, n, 0);
+		this->Nodes.resize(NextNode.load());
+		std::vector<unsigned>().swap(this->Codes);
+		this->Refit(bounds);
+	}
+
+	// Recompute every box bottom-up for new primitive bounds while keeping the hierarchy. Children are
+	// stored after their parent, so one backward pass over the interior nodes suffices
+	void Refit(const std::vector<AABB>& bounds)
+	{
+		int nNodes = this->Nodes.size();
+		#pragma omp parallel for if (nNodes > TaskSize)
+		for (int i = 0; i < nNodes; i++)
+		{
+			Node& node = this->Nodes[i];
+			if (node.count == 0)
+				continue;
+			node.box = AABB();
+			for (int k = node.offset; k < node.offset + node.count; k++)
+				node.box.Expand(bounds[this->PrimIdx[k]]);
+		}
+		for (int i = nNodes - 1; i >= 0; i--)
+		{
+			Node& node = this->Nodes[i];
+			if (node.count > 0)
+				continue;
+			node.box = this->Nodes[node.offset].box;
+			node.box.Expand(this->Nodes[node.offset + 1].box);
+		}
+	}
+
+	// Free the nodes once another structure was derived from them, only the leaf order is kept
+	void ReleaseNodes() { std::vector<Node>().swap(this->Nodes); }
+
+	int GetNumNodes() const { return this->Nodes.size(); }
+	const std::vector<Node>& GetNodes() const { return this->Nodes; }
+	const std::vector<int>& GetPrimIdx() const { return this->PrimIdx; }
+	AABB GetBounds() const { return this->Nodes.empty()? AABB() : this->Nodes[0].box; }
+
+	// Closest-hit traversal, the nearer child is visited first. leaf(prim, tmax) tests primitive prim
+	// and lowers tmax when it hits something closer, returns whether any leaf reported a hit
+	template <typename Leaf>
+	bool Traverse(const Ray& ray, float tmax, Leaf&& leaf) const
+	{
+		return this->TraverseLeaves(ray, tmax, [&](int begin, int end, float& tmax) {
+			bool result = false;
+			for (int i = begin; i < end; i++)
+				result |= leaf(this->PrimIdx[i], tmax);
+			return result;
+		});
+	}
+
+	// Same traversal handing out whole leaves, leaf(begin, end, tmax) tests the primitives at leaf
+	// order positions [begin, end) so that per-primitive data can be stored in that order
+	template <typename Leaf>
+	bool TraverseLeaves(const Ray& ray, float tmax, Leaf&& leaf) const
+	{
+		if (this->Nodes.empty())
+			return false;
+		float origin[3], inv[3];
+		bool negative[3];
+		for (int i = 0; i < 3; i++)
+		{
+			origin[i] = ray.getOrigin()[i];
+			inv[i] = ray.getInvDirection()[i];
+			negative[i] = ray.getSign(i);
+		}
+
+		int stack[StackSize];
+		int sp = 0;
+		int idx = 0;
+		bool result = false;
+		while (true)
+		{
+			const Node& node = this->Nodes[idx];
+			if (node.box.Intersect(origin, inv, tmax))
+			{
+				if (node.count > 0)
+					result |= leaf(node.offset, node.offset + node.count, tmax);
+				else if (negative[node.axis])
+				{
+					stack[sp++] = node.offset;
+					idx = node.offset + 1;
+					continue;
+				}
+				else
+				{
+					stack[sp++] = node.offset + 1;
+					idx = node.offset;
+					continue;
+				}
+			}
+			if (sp == 0)
+				break;
+			idx = stack[--sp];
+		}
+		return result;
+	}
+};
+
+#endif
@@ -30,14 +30,28 @@ public:
 	bool intersect(const Ray &r, Hit &h, float tmin) const override
 	{
 		bool result = false;
-		for (Object3D *item : this->ObjList)
+		for (Object3D *item : this->Unbounded)
 		{
 			result |= item->intersect(r, h, tmin);
 		}
+		result |= this->bvh.Traverse(r, h.getT(), [&](int idx, float& tmax) {
+			if (!this->Bounded[idx]->intersect(r, h, tmin))
+				return false;
+			tmax = h.getT();
+			return true;
+		});
 
 		return result;
 	}
 
+	bool GetBounds(AABB &box) const override
+	{
+		if (!this->Unbounded.empty() || this->Bounded.empty())
+			return false;
+		box = this->bvh.GetBounds();
+		return true;
+	}
+
 	HitSurface SamplePoint(double &pdf, RandomGenerator &rng) const override
 	{
 		int size = this->ObjList.size();
@@ -52,6 +66,45 @@ public:
 	void addObject(int index, Object3D *obj)
 	{
 		this->ObjList.push_back(obj);
+		this->Unbounded.push_back(obj);
+	}
+
+	// Put the bounded objects into a BVH, the rest are still tested one by one
+	void Build()
+	{
+		std::vector<AABB> bounds;
+		this->Bounded.clear();
+		this->Unbounded.clear();
+		for (Object3D *item : this->ObjList)
+		{
+			AABB box;
+			if (item->GetBounds(box))
+			{
+				this->Bounded.push_back(item);
+				bounds.push_back(box);
+			}
+			else
+				this->Unbounded.push_back(item);
+		}
+		this->bvh.Build(bounds);
+	}
+
+	// Follow objects that moved or deformed since Build(), by a Morton-code rebuild of the BVH or a
+	// refit of its current hierarchy
+	void Update(bool rebuild)
+	{
+		std::vector<AABB> bounds(this->Bounded.size());
+		for (size_t i = 0; i < this->Bounded.size(); i++)
+			this->Bounded[i]->GetBounds(bounds[i]);
+		if (rebuild)
+			this->bvh.BuildLBVH(bounds);
+		else
+			this->bvh.Refit(bounds);
+	}
+
+	int getNumUnbounded() const
+	{
+		return this->Unbounded.size();
 	}
 
 	int getGroupSize()
@@ -59,8 +112,16 @@ public:
 		return this->ObjList.size();
 	}
 
+	const std::vector<Object3D *> &getObjects() const
+	{
+		return this->ObjList;
+	}
+
 private:
 	std::vector<Object3D *> ObjList;
+	std::vector<Object3D *> Bounded;	// Objects of the BVH, in the order of its primitive indices
+	std::vector<Object3D *> Unbounded;	// Planes, or every object before Build()
+	BVHTree bvh;
 };
 
 #endif
@@ -6,6 +6,7 @@
 #include "utils.hpp"
 
 class Material;
+class Object3D;
 
 struct HitSurface
 {
@@ -25,6 +26,8 @@ struct HitSurface
 	}
 };
 
+// Closest candidate found by a traversal. Only what the object that recorded it needs to build
+// the surface is kept, finalize() builds the surface of the closest hit for the caller
 class Hit
 {
 public:
@@ -35,19 +38,14 @@ public:
 		this->t = INFINITY;
 	}
 
-	Hit(float _t, Material *m, const HitSurface &s)
+	// Accept only candidates closer than _t
+	explicit Hit(float _t, Material *m = nullptr)
 	{
 		this->t = _t;
 		this->material = m;
-		this->surface = s;
 	}
 
-	Hit(const Hit &h)
-	{
-		this->t = h.t;
-		this->material = h.material;
-		this->surface = h.surface;
-	}
+	Hit(const Hit &h) = default;
 
 	// destructor
 	~Hit() = default;
@@ -62,22 +60,69 @@ public:
 		return this->material;
 	}
 
-	const HitSurface &getSurface() const
+	// Record a candidate without building its surface, obj->GetSurface builds it in finalize()
+	// for the closest hit only. prim, u and v are whatever obj needs to do that
+	void record(float _t, Material *m, const Object3D *obj, int _prim = 0, float _u = 0.0f, float _v = 0.0f)
+	{
+		this->t = _t;
+		this->material = m;
+		this->objects[0] = obj;
+		this->depth = 1;
+		this->prim = _prim;
+		this->u = _u;
+		this->v = _v;
+		this->light = -1;
+	}
+
+	// Index of the light whose geometry was hit, -1 for other objects
+	void setLight(int idx) { this->light = idx; }
+	int getLight() const { return this->light; }
+
+	// Called by an object enclosing the one that recorded the hit, returns false when the chain is full
+	bool pushObject(const Object3D *obj)
 	{
-		return this->surface;
+		if (this->depth == MaxDepth)
+			return false;
+		for (int i = this->depth; i > 0; i--)
+			this->objects[i] = this->objects[i - 1];
+		this->objects[0] = obj;
+		this->depth++;
+		return true;
 	}
 
-	void set(float _t, Material *m, const HitSurface &s)
+	// Forget the objects below obj when the chain is full, obj then finds its hit again to build the surface
+	void restart(const Object3D *obj)
 	{
-		this->t = _t;
-		this->material = m;
-		this->surface = s;
+		this->objects[0] = obj;
+		this->depth = 1;
+	}
+
+	int getDepth() const { return this->depth; }
+
+	int getPrim() const { return this->prim; }
+	float getU() const { return this->u; }
+	float getV() const { return this->v; }
+
+	// Surface of the hit in the space of objects[level], r is the ray in that space
+	HitSurface getSurfaceAt(const Ray &r, int level) const;
+
+	// Surface of the recorded hit, r is the ray that was intersected
+	HitSurface finalize(const Ray &r) const
+	{
+		return this->getSurfaceAt(r, 0);
 	}
 
 private:
-	float t;
+	static const int MaxDepth = 3;
+
 	Material *material;
-	HitSurface surface;
+	// objects[0] is the outermost object and objects[depth - 1] recorded the hit
+	const Object3D *objects[MaxDepth];
+	float t;
+	float u = 0.0f, v = 0.0f;
+	int prim = 0;
+	int light = -1;
+	unsigned char depth = 0;
 };
 
 
@@ -17,6 +17,39 @@ public:
 
 	virtual bool intersect(const Ray &r, Hit &h, float tmin) const = 0;
 
+	// Geometry of the light, nullptr for lights that cannot be hit
+	virtual Object3D* GetObject() const { return nullptr; }
+
+};
+
+// Geometry of an area light placed among the scene objects, so that lights are found by the same
+// traversal as everything else. Hits are tagged with the index of the light, the object is not owned
+class Emitter : public Object3D
+{
+public:
+	Emitter(Object3D *object, int LightIdx) : object(object), LightIdx(LightIdx) {}
+
+	bool intersect(const Ray &r, Hit &h, float tmin) const override
+	{
+		if (!this->object->intersect(r, h, tmin))
+			return false;
+		h.setLight(this->LightIdx);
+		return true;
+	}
+
+	HitSurface SamplePoint(double &pdf, RandomGenerator &rng) const override
+	{
+		return this->object->SamplePoint(pdf, rng);
+	}
+
+	bool GetBounds(AABB &box) const override
+	{
+		return this->object->GetBounds(box);
+	}
+
+private:
+	Object3D *object;
+	int LightIdx;
 };
 
 class AreaLight : public Light
@@ -57,6 +90,11 @@ public:
 		return this->object->intersect(r, h, tmin);
 	}
 
+	Object3D* GetObject() const override
+	{
+		return this->object;
+	}
+
 private:
 	Object3D* object;
 	Vector3f power;
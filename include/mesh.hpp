@@ -4,8 +4,11 @@
 #include <vector>
 #include <map>
 #include <numeric>
+#include <memory>
 #include "object3d.hpp"
 #include "triangle.hpp"
+#include "bvh.hpp"
+#include "wide_bvh.hpp"
 #include "Vector2f.h"
 #include "Vector3f.h"
 
@@ -31,8 +34,8 @@ public:
 		bool inside = true;
 		enum {LEFT, RIGHT, MIDDLE} pos[3];
 		Vector3f Candidate;
-		Vector3f origin = ray.getOrigin(), dir = ray.getDirection().normalized();
-		float length = ray.getDirection().length();
+		const Vector3f &origin = ray.getOrigin(), &dir = ray.getUnitDirection();
+		float length = ray.getLength();
 		for (int i = 0; i < 3; i++)
 		{
 			if (origin[i] < this->LowerLeftBehind[i])
@@ -71,24 +74,19 @@ public:
 			}
 			if (tmax  < 0 || tmax / length > hit.getT())
 				return false;
+			// Only the distance is used by the octree, the box needs no surface
 			Vector3f position = ray.GetAt(tmax / length);
-			Vector3f normal;
 			for (int i = 0; i < 3; i++)
 			{
-				if (maxIdx != i)
-				{
-					if (position[i] < this->LowerLeftBehind[i] || position[i] > this->UpperRightFront[i])
-						return false;
-				}
-				else
-					normal[i] = (pos[i] == RIGHT)? -1 : 1;
+				if (maxIdx != i && (position[i] < this->LowerLeftBehind[i] || position[i] > this->UpperRightFront[i]))
+					return false;
 			}
-			hit.set(tmax / length, nullptr, {position, normal});
+			hit.record(tmax / length, nullptr, this);
 			return true;
 		}
 		else
 		{
-			hit.set(0, nullptr, {Vector3f::ZERO, Vector3f::ZERO});
+			hit.record(0, nullptr, this);
 			return true;
 		}
 	}
@@ -139,36 +137,157 @@ protected:
 
 class Octree;
 
-class Mesh : public Object3D
+enum MeshAccel {OCTREE, BVH, WIDE_BVH, QUANTIZED_BVH};	// QUANTIZED_BVH is the wide BVH with 8-bit child boxes
+
+// Triangles, materials and acceleration structure of one OBJ file, shared by every Mesh placing it.
+// Corners with equal position, normal and texture coordinate are welded into one vertex, which can
+// be stored quantized: positions in 16-bit steps of the mesh box and normals in octahedral form.
+// A deformable mesh only welds corners sharing the same OBJ position and normal
+class MeshData
 {
 
 public:
-	Mesh(const char *filename, Material *m);
-	~Mesh();
+	MeshData(const char *filename, MeshAccel accel = MeshAccel::WIDE_BVH, bool quantize = false, bool deformable = false);
+	~MeshData();
+	MeshData(const MeshData&) = delete;
+	MeshData& operator=(const MeshData&) = delete;
 
-	struct TriangleIndex
+	struct TriangleIndex		// 16 bytes
 	{
-		int vIdx[3] = {};
-		int nIdx[3] = {};
-		int texIdx[3] = {};
-		bool hasNormal = false;
-		bool hasTexture = false;
-		Material* material;
+		int v[3];					// Welded vertices
+		unsigned short material;	// Into the material table, 0 for the material of the instance
+		bool hasNormal;
+		bool hasTexture;
 	};
-	bool intersect(const Ray &r, Hit &h, float tmin) const override;
-	HitSurface SamplePoint(double &pdf, RandomGenerator &rng) const override;
+
+	// Closest hit of a ray, t is the limit on input and the distance of the hit on output
+	struct MeshHit
+	{
+		float t;
+		int idx;			// Triangle index
+		float beta, gamma;	// Barycentrics of the second and third vertex
+	};
+
+	bool intersect(const Ray &r, float tmin, MeshHit &hit) const;
+	// fallback is the material of faces without one of their own
+	Material* GetMaterial(size_t idx, Material *fallback) const { return this->t[idx].material? this->materials[this->t[idx].material] : fallback; }
+	Triangle GetTriangle(size_t idx, Material *fallback) const;
+	// Shading data of a hit on triangle idx, beta and gamma weight its second and third vertex
+	HitSurface GetSurface(size_t idx, const Vector3f &position, float beta, float gamma, Material *material) const;
+	int GetNumTriangles() const { return this->t.size(); }
+	int GetNumVertices() const { return this->QuantizedV.empty()? this->v.size() : this->QuantizedV.size() / 3; }
+	AABB GetBounds() const { return this->bounds; }
+
+	Vector3f GetPosition(int i) const
+	{
+		if (this->QuantizedV.empty())
+			return this->v[i];
+		const unsigned short *q = &this->QuantizedV[3 * i];
+		return Vector3f(this->bounds.min[0] + q[0] * this->step[0], this->bounds.min[1] + q[1] * this->step[1], this->bounds.min[2] + q[2] * this->step[2]);
+	}
+
+	Vector3f GetNormal(int i) const
+	{
+		if (this->QuantizedN.empty())
+			return this->n[i];
+		// Octahedral decoding, the lower hemisphere is folded over the diagonals
+		float x = (this->QuantizedN[i] & 0xffff) / 32767.5f - 1.0f, y = (this->QuantizedN[i] >> 16) / 32767.5f - 1.0f;
+		float z = 1.0f - std::abs(x) - std::abs(y);
+		if (z < 0.0f)
+		{
+			float fx = (1.0f - std::abs(y)) * (x < 0.0f? -1.0f : 1.0f), fy = (1.0f - std::abs(x)) * (y < 0.0f? -1.0f : 1.0f);
+			x = fx;
+			y = fy;
+		}
+		return Vector3f(x, y, z).normalized();
+	}
+
+	// Move the vertices to new positions, and replace the normals when there is one per normal of the
+	// mesh. Both are indexed like the v and vn lines of the OBJ file, and the mesh must have been loaded
+	// as deformable. The BVH is rebuilt along a Morton curve or refit, an octree is always built again
+	bool Deform(const std::vector<Vector3f> &positions, const std::vector<Vector3f> &normals, bool rebuild);
+	// Vertex positions and normals of an OBJ file, everything else is skipped
+	static bool ReadVertices(const char *filename, std::vector<Vector3f> &positions, std::vector<Vector3f> &normals);
 
 private:
 	void parseMtl(const string& filename);
-	
-	std::vector<Vector3f> v;
+	void BuildOctree();
+	void SetPositions(const std::vector<Vector3f> &positions);
+	void SetNormals(const std::vector<Vector3f> &normals);
+	std::vector<AABB> GetTriangleBounds() const;
+	void UpdateRecords();
+	void BuildWide();
+
 	std::vector<TriangleIndex> t;
-	std::vector<Vector3f> n;
-	std::vector<Vector2f> texcoord;
+	std::vector<Vector3f> v;					// Welded vertex positions, empty when quantized
+	std::vector<unsigned short> QuantizedV;		// 3 per vertex, in steps of step from bounds.min
+	std::vector<Vector3f> n;					// Per welded vertex when any face has normals, empty when quantized
+	std::vector<unsigned> QuantizedN;			// Octahedral normals, two 16-bit coordinates
+	std::vector<Vector2f> texcoord;				// Per welded vertex when any face has texture coordinates
+
+	// OBJ position and normal of each vertex of a deformable mesh, -1 when it had no normal
+	struct VertexSource
+	{
+		int position;
+		int normal;
+	};
+	std::vector<VertexSource> source;
+	int ObjPositions = 0;
+	int ObjNormals = 0;
+
 	std::map<std::string, Material*> MeshMaterial;
+	std::vector<Material*> materials{nullptr};	// Material table, entry 0 stands for the instance material
+
+	bool quantize;
+	AABB bounds;
+	float step[3] = {};
+
+	// Intersection records of the BVH, stored in leaf order with one array per component
+	struct TriangleRecords
+	{
+		std::vector<float> v0[3];
+		std::vector<float> e1[3];	// v1 - v0
+		std::vector<float> e2[3];	// v2 - v0
+	} records;
 
 	friend class Octree;
+	MeshAccel accel;
 	Octree* tree = nullptr;
+	BVHTree bvh;			// Nodes are dropped once a wide tree is built, unless the mesh is deformable
+	WideBVH<4> Wide4;		// Only one of the wide trees is built, 8-wide when the CPU has AVX2
+	WideBVH<8> Wide8;
+	TriangleView view;
+};
+
+// Placement of mesh geometry, instances of one OBJ file share its MeshData
+class Mesh : public Object3D
+{
+
+public:
+	Mesh(const char *filename, Material *m, MeshAccel accel = MeshAccel::WIDE_BVH) : Object3D(m), data(std::make_shared<const MeshData>(filename, accel)) {}
+	Mesh(std::shared_ptr<const MeshData> data, Material *m) : Object3D(m), data(std::move(data)) {}
+
+	bool intersect(const Ray &r, Hit &h, float tmin) const override
+	{
+		MeshData::MeshHit hit;
+		hit.t = h.getT();
+		if (!this->data->intersect(r, tmin, hit))
+			return false;
+		h.record(hit.t, this->data->GetMaterial(hit.idx, this->material), this, hit.idx, hit.beta, hit.gamma);
+		return true;
+	}
+
+	HitSurface GetSurface(const Ray &r, const Hit &h, int level) const override
+	{
+		return this->data->GetSurface(h.getPrim(), r.GetAt(h.getT()), h.getU(), h.getV(), h.getMaterial());
+	}
+
+	HitSurface SamplePoint(double &pdf, RandomGenerator &rng) const override;
+	bool GetBounds(AABB &box) const override { box = this->data->GetBounds(); return true; }
+	std::shared_ptr<const MeshData> GetData() const { return this->data; }
+
+private:
+	std::shared_ptr<const MeshData> data;
 };
 
 class Octree
@@ -195,7 +314,7 @@ private:
 	const int MaxDepth = 8;		// Max depth of the tree
 
 	OctNode *root = nullptr;
-	Mesh *mesh = nullptr;
+	MeshData *mesh = nullptr;
 
 	OctNode* Add(BBox* BoundingBox, const std::vector<size_t>& IdxList, int depth)
 	{
@@ -224,8 +343,8 @@ private:
 
 		for (size_t idx : IdxList)
 		{
-			const Mesh::TriangleIndex& triIdx = this->mesh->t[idx];
-			Vector3f vertices[3] = {this->mesh->v[triIdx.vIdx[0]], this->mesh->v[triIdx.vIdx[1]], this->mesh->v[triIdx.vIdx[2]]};
+			const MeshData::TriangleIndex& triIdx = this->mesh->t[idx];
+			Vector3f vertices[3] = {this->mesh->GetPosition(triIdx.v[0]), this->mesh->GetPosition(triIdx.v[1]), this->mesh->GetPosition(triIdx.v[2])};
 		//	bool flag = false;
 			for (int i = 0; i < 8; i++)
 			{
@@ -246,7 +365,7 @@ private:
 
 public:
 	Octree() = delete;
-	Octree(Mesh* m) : root(nullptr), mesh(m) {}
+	Octree(MeshData* m) : root(nullptr), mesh(m) {}
 	~Octree () { delete this->root;}
 
 	void Build(BBox* BoundingBox)
@@ -255,15 +374,15 @@ public:
 		std::iota(IdxArray.begin(), IdxArray.end(), 0);
 		this->root = Add(BoundingBox, IdxArray, 1);
 	}
-	bool Traverse(OctNode* node, const Ray &r, Hit &h, float tmin) const;
+	bool Traverse(OctNode* node, const Ray &r, float tmin, MeshData::MeshHit &hit) const;
 
-	bool intersect(const Ray &r, Hit &h, float tmin) const
+	bool intersect(const Ray &r, float tmin, MeshData::MeshHit &hit) const
 	{
-		Hit htmp = h;
+		Hit htmp(hit.t);
 		if (!this->root->BoundingBox->intersect(r, htmp, tmin))
 			return false;
 
-		if (!Traverse(this->root, r, h, tmin))
+		if (!Traverse(this->root, r, tmin, hit))
 			return false;
 		return true;
 	}
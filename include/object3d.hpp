@@ -5,6 +5,7 @@
 #include "hit.hpp"
 #include "material.hpp"
 #include "utils.hpp"
+#include "bvh.hpp"
 
 // Base class for all 3d entities.
 class Object3D
@@ -25,8 +26,23 @@ public:
 	// Sample point on the object
 	virtual HitSurface SamplePoint(double& pdf, RandomGenerator& rng) const = 0;
 
+	// Box enclosing the object, returns false for unbounded objects such as planes
+	virtual bool GetBounds(AABB& box) const { return false; }
+
+	// Surface of a hit recorded through Hit::record, r is the ray in the space of this object
+	// and level the position of this object in the chain of the hit. Objects that never record
+	// hits of their own keep this
+	virtual HitSurface GetSurface(const Ray& r, const Hit& h, int level) const { return HitSurface(r.GetAt(h.getT()), Vector3f::ZERO); }
+
 protected:
 	Material *material;
 };
 
+inline HitSurface Hit::getSurfaceAt(const Ray &r, int level) const
+{
+	if (level >= this->depth)
+		return HitSurface(r.GetAt(this->t), Vector3f::ZERO);
+	return this->objects[level]->GetSurface(r, *this, level);
+}
+
 #endif
@@ -3,8 +3,9 @@
 
 #include <vecmath.h>
 #include <cmath>
+#include <cstdint>
 #include <algorithm>
-#include <queue>
+#include <cassert>
 #include <numeric>
 #include <omp.h>
 #include "utils.hpp"
@@ -16,175 +17,617 @@ struct Photon
 	Vector3f power;
 };
 
-struct Node
+// 20-byte photon: octahedral-mapped direction in two 16-bit values, power in RGBE
+struct CompactPhoton
 {
-	int idx;
-	int axis;
-	Node* left;
-	Node* right;
+	Vector3f pos;
+	uint16_t dir[2];
+	uint8_t power[4];
+
+	CompactPhoton() {}
+	CompactPhoton(const Photon& photon) : pos(photon.pos)
+	{
+		// Project onto the octahedron |x| + |y| + |z| = 1 and fold the lower half over the diagonals
+		const Vector3f& d = photon.dir;
+		float norm = std::abs(d[0]) + std::abs(d[1]) + std::abs(d[2]);
+		float u = (norm > 0)? d[0] / norm : 0.0f;
+		float v = (norm > 0)? d[1] / norm : 0.0f;
+		if (d[2] < 0)
+		{
+			float fu = (1.0f - std::abs(v)) * ((u >= 0)? 1.0f : -1.0f);
+			float fv = (1.0f - std::abs(u)) * ((v >= 0)? 1.0f : -1.0f);
+			u = fu;
+			v = fv;
+		}
+		this->dir[0] = (uint16_t) std::lround((u * 0.5f + 0.5f) * 65535.0f);
+		this->dir[1] = (uint16_t) std::lround((v * 0.5f + 0.5f) * 65535.0f);
+
+		// Ward's shared exponent encoding
+		const Vector3f& p = photon.power;
+		float max = std::max(p[0], std::max(p[1], p[2]));
+		if (max < 1e-32f)
+		{
+			this->power[0] = this->power[1] = this->power[2] = this->power[3] = 0;
+			return;
+		}
+		int exp;
+		float scale = std::frexp(max, &exp) * 256.0f / max;
+		for (int i = 0; i < 3; i++)
+			this->power[i] = (uint8_t) std::min(255.0f, std::max(0.0f, p[i] * scale));
+		this->power[3] = (uint8_t) (exp + 128);
+	}
+
+	Vector3f GetDir() const
+	{
+		float u = this->dir[0] / 65535.0f * 2.0f - 1.0f;
+		float v = this->dir[1] / 65535.0f * 2.0f - 1.0f;
+		float w = 1.0f - std::abs(u) - std::abs(v);
+		if (w < 0)
+		{
+			float fu = (1.0f - std::abs(v)) * ((u >= 0)? 1.0f : -1.0f);
+			float fv = (1.0f - std::abs(u)) * ((v >= 0)? 1.0f : -1.0f);
+			u = fu;
+			v = fv;
+		}
+		return Vector3f(u, v, w).normalized();
+	}
+
+	Vector3f GetPower() const
+	{
+		if (this->power[3] == 0)
+			return Vector3f::ZERO;
+		// A zero mantissa stays zero so that pure colours are not tinted
+		float f = std::ldexp(1.0f, (int)this->power[3] - (128 + 8));
+		auto channel = [&](int i) { return this->power[i]? (this->power[i] + 0.5f) * f : 0.0f; };
+		return Vector3f(channel(0), channel(1), channel(2));
+	}
+
+	Photon Decode() const { return Photon{this->pos, this->GetDir(), this->GetPower()}; }
 };
 
-class KdTree
+// Move the photons into the given order by following its cycles, Order[i] is the photon that ends up at i
+// Order is left as the identity afterwards
+template <typename PhotonT>
+void ReorderPhotons(PhotonT* photons, std::vector<int>& Order, int num)
+{
+	for (int i = 0; i < num; i++)
+	{
+		if (Order[i] == i)
+			continue;
+		PhotonT tmp = photons[i];
+		int cur = i;
+		while (true)
+		{
+			int src = Order[cur];
+			Order[cur] = cur;
+			if (src == i)
+			{
+				photons[cur] = tmp;
+				break;
+			}
+			photons[cur] = photons[src];
+			cur = src;
+		}
+	}
+}
+
+const int MaxKNN = 128;		// Largest k supported by the KNN searches
+
+// Whether a KNN search for k photons can run, a k above MaxKNN is reported instead of being clamped
+inline bool ValidKNN(int k)
+{
+	if (k > MaxKNN)
+		logging::ERROR("KNN search for " + std::to_string(k) + " photons, at most " + std::to_string(MaxKNN) + " are supported");
+	return k > 0 && k <= MaxKNN;
+}
+
+template <int Capacity>
+class KnnHeap		// Fixed-capacity max-heap of (squared distance, index), lives on the stack
 {
 private:
-	Photon* Photons;
+	std::pair<float, int> items[Capacity];
+	int size;
+	int k;
+
+public:
+	KnnHeap(int k) : size(0), k(k) { assert(k > 0 && k <= Capacity); }
+
+	void Push(float dist, int idx)
+	{
+		if (this->size < this->k)
+		{
+			this->items[this->size++] = {dist, idx};
+			std::push_heap(this->items, this->items + this->size);
+		}
+		else if (dist < this->items[0].first)
+		{
+			std::pop_heap(this->items, this->items + this->size);
+			this->items[this->size - 1] = {dist, idx};
+			std::push_heap(this->items, this->items + this->size);
+		}
+	}
+
+	bool Full() const { return this->size >= this->k; }
+	bool Empty() const { return this->size == 0; }
+	int Size() const { return this->size; }
+	float Top() const { return this->items[0].first; }
+	const std::pair<float, int>& operator[] (int i) const { return this->items[i]; }
+};
+
+template <typename PhotonT>
+class KdTree		// Implicit left-balanced kd-tree, children of node i are 2i+1 and 2i+2
+{
+private:
+	PhotonT* Photons;
 	int num;
-	Node* root;
-	const int max_parallel_lvl = (int) std::log2(omp_get_max_threads());
+	std::vector<int> IdxArray;			// Reused between builds
+	std::vector<int> Order;				// Tree position -> original photon index
+	std::vector<unsigned char> Axis;	// Split axis of each tree position
+	static const int ParallelGrain = 4096;		// Subtrees smaller than this are built by a single task
+
+	static int LeftSubtreeSize(int n)
+	{
+		if (n <= 1)
+			return 0;
+		int height = 0;
+		while ((2 << height) <= n)
+			height++;
+		int full = (1 << height) - 1;	// Nodes above the last level
+		int last = n - full;			// Nodes on the last level
+		return (full - 1) / 2 + std::min(last, 1 << (height - 1));
+	}
 
-	Node* KdNodeBuild(int* IdxArray, int n, int level)
+	// Split at the left-balanced median with nth_element, O(n) per level and O(n log n) in total
+	void KdNodeBuild(int* IdxArray, int n, int pos, int level)
 	{
 		if (n <= 0)
-			return nullptr;
+			return;
 		int axis = level % 3;
-		std::sort(IdxArray, IdxArray + n, [&](const int a, const int b) {return this->Photons[a].pos[axis] < this->Photons[b].pos[axis];});
-		int mid = (n - 1) / 2;
-		Node* pthis = new Node;
-		pthis->axis = axis;
-		pthis->idx = IdxArray[mid];
-		if (level < this->max_parallel_lvl + 1)
-		{
-			#pragma omp task firstprivate(pthis)
-			pthis->left = KdNodeBuild(IdxArray, mid, level + 1);
-			#pragma omp task firstprivate(pthis)
-			pthis->right = KdNodeBuild(IdxArray + mid + 1, n - mid - 1, level + 1);
+		int mid = LeftSubtreeSize(n);
+		std::nth_element(IdxArray, IdxArray + mid, IdxArray + n, [&](const int a, const int b) {return this->Photons[a].pos[axis] < this->Photons[b].pos[axis];});
+		this->Order[pos] = IdxArray[mid];
+		this->Axis[pos] = axis;
+		if (n > this->ParallelGrain)
+		{
+			#pragma omp task
+			KdNodeBuild(IdxArray, mid, 2 * pos + 1, level + 1);
+			#pragma omp task
+			KdNodeBuild(IdxArray + mid + 1, n - mid - 1, 2 * pos + 2, level + 1);
 			#pragma omp taskwait
 		}
 		else 
 		{
-			pthis->left = KdNodeBuild(IdxArray, mid, level + 1);
-			pthis->right = KdNodeBuild(IdxArray + mid + 1, n - mid - 1, level + 1);
+			KdNodeBuild(IdxArray, mid, 2 * pos + 1, level + 1);
+			KdNodeBuild(IdxArray + mid + 1, n - mid - 1, 2 * pos + 2, level + 1);
 		}
-		return pthis;
 	}
 
-	void SearchKNearestNode(Node* node, const Vector3f& target, int k, std::priority_queue<std::pair<float, int>>& queue)
+	template <int Capacity>
+	void SearchKNearestNode(int pos, const Vector3f& target, KnnHeap<Capacity>& heap)
 	{
-		if (node == nullptr)
+		if (pos >= this->num)
 			return;
-		float dist = (target - this->Photons[node->idx].pos).squaredLength();
-		queue.emplace(dist, node->idx);
-		if ((int)queue.size() > k)
-			queue.pop();
-		float diff = target[node->axis] - this->Photons[node->idx].pos[node->axis];
+		const PhotonT& photon = this->Photons[pos];
+		int axis = this->Axis[pos];
+		heap.Push((target - photon.pos).squaredLength(), pos);
+		float diff = target[axis] - photon.pos[axis];
 		if (diff < 0)
-			SearchKNearestNode(node->left, target, k, queue);
+			SearchKNearestNode(2 * pos + 1, target, heap);
 		else
-			SearchKNearestNode(node->right, target, k, queue);
-		if (queue.top().first > diff * diff || (int)queue.size() < k)
+			SearchKNearestNode(2 * pos + 2, target, heap);
+		if (!heap.Full() || heap.Top() > diff * diff)
 		{
 			if (diff < 0)
-				SearchKNearestNode(node->right, target, k, queue);
+				SearchKNearestNode(2 * pos + 2, target, heap);
 			else
-				SearchKNearestNode(node->left, target, k, queue);
+				SearchKNearestNode(2 * pos + 1, target, heap);
 		}
 		
 	}
 
-	void SearchNodeInRange(Node* node, const Vector3f& target, float radius2, std::vector<int>& list)
+	template <typename Visitor>
+	void SearchNodeInRange(int pos, const Vector3f& target, float radius2, Visitor& visit)
 	{
-		if (node == nullptr)
+		if (pos >= this->num)
 			return;
-		float dist = (target - this->Photons[node->idx].pos).squaredLength();
+		const PhotonT& photon = this->Photons[pos];
+		int axis = this->Axis[pos];
+		float dist = (target - photon.pos).squaredLength();
 		if (dist < radius2)
-			list.push_back(node->idx);
-		float diff = target[node->axis] - this->Photons[node->idx].pos[node->axis];
+			visit(photon, pos);
+		float diff = target[axis] - photon.pos[axis];
 		if (diff < 0)
-			SearchNodeInRange(node->left, target, radius2, list);
+			SearchNodeInRange(2 * pos + 1, target, radius2, visit);
 		else
-			SearchNodeInRange(node->right, target, radius2, list);
+			SearchNodeInRange(2 * pos + 2, target, radius2, visit);
 		if (radius2 > diff * diff)
 		{
 			if (diff < 0)
-				SearchNodeInRange(node->right, target, radius2, list);
+				SearchNodeInRange(2 * pos + 2, target, radius2, visit);
 			else
-				SearchNodeInRange(node->left, target, radius2, list);
+				SearchNodeInRange(2 * pos + 1, target, radius2, visit);
 		}
 		
 	}
 
-	void ClearNode(Node* node)
+public:
+	KdTree() : Photons(nullptr), num(0) {}
+	KdTree(PhotonT* photons, int n) : Photons(photons), num(n) {}
+
+	void Set(PhotonT* photons, int n){ this->Photons = photons; this->num = n; }
+
+	// Build the tree and reorder the photons in place, so indices returned by searches are tree positions
+	void Build()
+	{
+		// resize() keeps the capacity, so storage is only allocated when the photon count grows
+		this->IdxArray.resize(this->num);
+		this->Order.resize(this->num);
+		this->Axis.resize(this->num);
+		std::iota(this->IdxArray.begin(), this->IdxArray.end(), 0);
+		#pragma omp parallel
+		{
+			#pragma omp single
+			{
+				this->KdNodeBuild(this->IdxArray.data(), this->num, 0, 0);
+			}
+		}
+		ReorderPhotons(this->Photons, this->Order, this->num);
+	}
+
+	// visit(photon, index) is called for the k nearest photons, returns the largest squared distance
+	template <typename Visitor>
+	float SearchKNN(const Vector3f& target, int k, Visitor&& visit)
+	{
+		if (!ValidKNN(k))
+			return 0;
+		KnnHeap<MaxKNN> heap(k);
+		this->SearchKNearestNode(0, target, heap);
+		for (int i = 0; i < heap.Size(); i++)
+			visit(this->Photons[heap[i].second], heap[i].second);
+		return heap.Empty()? 0 : heap.Top();
+	}
+
+	// visit(photon, index) is called for every photon closer than sqrt(radius2)
+	template <typename Visitor>
+	void SearchNIR(const Vector3f& target, float radius2, Visitor&& visit)
 	{
-		if (node == nullptr)
+		this->SearchNodeInRange(0, target, radius2, visit);
+	}
+
+	void Clear() { this->num = 0; }
+};
+
+template <typename PhotonT>
+class HashGrid		// Uniform grid hashed into a table, photons of a bucket are stored contiguously
+{
+private:
+	PhotonT* Photons;
+	int num;
+	float CellSize;
+	Vector3f Origin;
+	int Dim[3];
+	unsigned Mask;
+	std::vector<unsigned> Bucket;		// Bucket of each photon, reused between builds
+	std::vector<int> BucketStart;		// Photons of bucket b are [BucketStart[b], BucketStart[b + 1])
+	std::vector<int> Fill;
+	std::vector<int> Order;
+
+	void GetCell(const Vector3f& p, int cell[3]) const
+	{
+		for (int i = 0; i < 3; i++)
+			cell[i] = (int) std::floor((p[i] - this->Origin[i]) / this->CellSize);
+	}
+
+	unsigned HashCell(int x, int y, int z) const
+	{
+		return ((unsigned)x * 73856093u ^ (unsigned)y * 19349663u ^ (unsigned)z * 83492791u) & this->Mask;
+	}
+
+	// Different cells may share a bucket, so photons are checked against the cell being visited
+	bool InCell(const PhotonT& photon, int x, int y, int z) const
+	{
+		int cell[3];
+		this->GetCell(photon.pos, cell);
+		return cell[0] == x && cell[1] == y && cell[2] == z;
+	}
+
+	template <typename Visitor>
+	void SearchCellInRange(int x, int y, int z, const Vector3f& target, float radius2, Visitor& visit)
+	{
+		unsigned b = this->HashCell(x, y, z);
+		for (int i = this->BucketStart[b]; i < this->BucketStart[b + 1]; i++)
+		{
+			if ((target - this->Photons[i].pos).squaredLength() < radius2 && this->InCell(this->Photons[i], x, y, z))
+				visit(this->Photons[i], i);
+		}
+	}
+
+	template <int Capacity>
+	void SearchKNearestCell(int x, int y, int z, const Vector3f& target, KnnHeap<Capacity>& heap)
+	{
+		if (x < 0 || y < 0 || z < 0 || x >= this->Dim[0] || y >= this->Dim[1] || z >= this->Dim[2])
 			return;
-		ClearNode(node->right);
-		ClearNode(node->left);
-		delete node;
+		unsigned b = this->HashCell(x, y, z);
+		for (int i = this->BucketStart[b]; i < this->BucketStart[b + 1]; i++)
+		{
+			if (this->InCell(this->Photons[i], x, y, z))
+				heap.Push((target - this->Photons[i].pos).squaredLength(), i);
+		}
 	}
 
 public:
-	KdTree() : Photons(nullptr), num(0), root(nullptr) {}
-	KdTree(Photon* photons, int n) : Photons(photons), num(n), root(nullptr) {}
-	~KdTree() { this->Clear(); }
+	HashGrid() : Photons(nullptr), num(0), CellSize(1.0f), Dim{0, 0, 0}, Mask(0) {}
+	HashGrid(PhotonT* photons, int n) : Photons(photons), num(n), CellSize(1.0f), Dim{0, 0, 0}, Mask(0) {}
 
-	void Set(Photon* photons, int n){ this->Photons = photons; this->num = n; this->root = nullptr; }
-	void Build()
+	void Set(PhotonT* photons, int n){ this->Photons = photons; this->num = n; }
+
+	// Counting sort of the photons into buckets, photons are reordered in place
+	void Build(float CellSize)
 	{
-		std::vector<int> IdxArray(this->num);
-		std::iota(IdxArray.begin(), IdxArray.end(), 0);
+		this->CellSize = CellSize;
+		Vector3f max(-INFINITY, -INFINITY, -INFINITY);
+		Vector3f min(INFINITY, INFINITY, INFINITY);
 		#pragma omp parallel
 		{
-			#pragma omp single
+			Vector3f lmax(-INFINITY, -INFINITY, -INFINITY);
+			Vector3f lmin(INFINITY, INFINITY, INFINITY);
+			#pragma omp for nowait
+			for (int i = 0; i < this->num; i++)
 			{
-				this->root = this->KdNodeBuild(IdxArray.data(), this->num, 0);
+				for (int j = 0; j < 3; j++)
+				{
+					lmax[j] = std::max(lmax[j], this->Photons[i].pos[j]);
+					lmin[j] = std::min(lmin[j], this->Photons[i].pos[j]);
+				}
 			}
+			#pragma omp critical
+			{
+				for (int j = 0; j < 3; j++)
+				{
+					max[j] = std::max(max[j], lmax[j]);
+					min[j] = std::min(min[j], lmin[j]);
+				}
+			}
+		}
+		this->Origin = (this->num > 0)? min : Vector3f::ZERO;
+		for (int i = 0; i < 3; i++)
+			this->Dim[i] = (this->num > 0)? (int)((max[i] - min[i]) / this->CellSize) + 1 : 0;
+
+		unsigned size = 1;
+		while (size < (unsigned)this->num)
+			size <<= 1;
+		this->Mask = size - 1;
+
+		// resize() keeps the capacity, so storage is only allocated when the photon count grows
+		this->Bucket.resize(this->num);
+		this->Order.resize(this->num);
+		this->BucketStart.assign(size + 1, 0);
+		#pragma omp parallel for
+		for (int i = 0; i < this->num; i++)
+		{
+			int cell[3];
+			this->GetCell(this->Photons[i].pos, cell);
+			unsigned b = this->HashCell(cell[0], cell[1], cell[2]);
+			this->Bucket[i] = b;
+			#pragma omp atomic
+			this->BucketStart[b + 1]++;
+		}
+		for (unsigned b = 0; b < size; b++)
+			this->BucketStart[b + 1] += this->BucketStart[b];
+
+		this->Fill.assign(this->BucketStart.begin(), this->BucketStart.end() - 1);
+		#pragma omp parallel for
+		for (int i = 0; i < this->num; i++)
+		{
+			int pos;
+			#pragma omp atomic capture
+			pos = this->Fill[this->Bucket[i]]++;
+			this->Order[pos] = i;
 		}
+		ReorderPhotons(this->Photons, this->Order, this->num);
 	}
 
-	float SearchKNN(const Vector3f& target, int k, std::vector<int>& result)
+	// visit(photon, index) is called for the k nearest photons, returns the largest squared distance
+	template <typename Visitor>
+	float SearchKNN(const Vector3f& target, int k, Visitor&& visit)
 	{
-		std::priority_queue<std::pair<float, int>> queue;
-		this->SearchKNearestNode(this->root, target, k, queue);
-		result.resize(queue.size());
-		float max_dist = queue.top().first;
-		for (size_t i = 0; i < queue.size(); i++)
+		if (!ValidKNN(k))
+			return 0;
+		KnnHeap<MaxKNN> heap(k);
+		int c[3];
+		this->GetCell(target, c);
+		int MaxRing = 0;
+		for (int i = 0; i < 3; i++)
+			MaxRing = std::max(MaxRing, std::max(std::abs(c[i]), std::abs(this->Dim[i] - 1 - c[i])));
+
+		// Visit shells of cells around the target, photons outside shell d are at least d * CellSize away
+		for (int d = 0; d <= MaxRing; d++)
 		{
-			result[i] = queue.top().second;
-			queue.pop();
+			for (int x = c[0] - d; x <= c[0] + d; x++)
+			{
+				for (int y = c[1] - d; y <= c[1] + d; y++)
+				{
+					bool face = (std::abs(x - c[0]) == d || std::abs(y - c[1]) == d);
+					int step = (face || d == 0)? 1 : 2 * d;
+					for (int z = c[2] - d; z <= c[2] + d; z += step)
+						this->SearchKNearestCell(x, y, z, target, heap);
+				}
+			}
+			if (heap.Full() && heap.Top() <= (d * this->CellSize) * (d * this->CellSize))
+				break;
 		}
-		return max_dist;
+
+		for (int i = 0; i < heap.Size(); i++)
+			visit(this->Photons[heap[i].second], heap[i].second);
+		return heap.Empty()? 0 : heap.Top();
 	}
 
-	int SearchNIR(const Vector3f& target, float radius2, std::vector<int>& result)
+	// visit(photon, index) is called for every photon closer than sqrt(radius2)
+	template <typename Visitor>
+	void SearchNIR(const Vector3f& target, float radius2, Visitor&& visit)
 	{
-		this->SearchNodeInRange(this->root, target, radius2, result);
-		return result.size();
+		if (this->num == 0)
+			return;
+		float radius = std::sqrt(radius2);
+		int lo[3], hi[3];
+		this->GetCell(target - Vector3f(radius, radius, radius), lo);
+		this->GetCell(target + Vector3f(radius, radius, radius), hi);
+		for (int i = 0; i < 3; i++)
+		{
+			lo[i] = std::max(lo[i], 0);
+			hi[i] = std::min(hi[i], this->Dim[i] - 1);
+		}
+		for (int x = lo[0]; x <= hi[0]; x++)
+			for (int y = lo[1]; y <= hi[1]; y++)
+				for (int z = lo[2]; z <= hi[2]; z++)
+					this->SearchCellInRange(x, y, z, target, radius2, visit);
 	}
 
-	void Clear() { this->ClearNode(this->root); this->root = nullptr; }
+	void Clear() { this->num = 0; }
 };
 
+enum MapType {KDTREE, HASHGRID};
+
 class PhotonMap
 {
 private:
 	std::vector<Photon> Photons;
-	KdTree kdtree;
+	std::vector<CompactPhoton> CompactPhotons;	// Used instead of Photons after Build() in compact mode
+	MapType type;
+	bool compact;
+	KdTree<Photon> kdtree;
+	HashGrid<Photon> grid;
+	KdTree<CompactPhoton> CompactKdtree;
+	HashGrid<CompactPhoton> CompactGrid;
 
 public:
-	PhotonMap(){}
-	PhotonMap(const std::vector<Photon>& photons) : Photons(photons) {}
+	PhotonMap(MapType type = MapType::KDTREE, bool compact = false) : type(type), compact(compact) {}
+	PhotonMap(const std::vector<Photon>& photons, MapType type = MapType::KDTREE, bool compact = false) : Photons(photons), type(type), compact(compact) {}
 
-	void Set(const std::vector<Photon>& photons) { this->Photons = photons; }
+	void Set(std::vector<Photon>&& photons) { this->Photons = std::move(photons); }
+	// Hand the photon storage back to the caller so its capacity can be reused, the map is left empty
+	std::vector<Photon> Release() { std::vector<Photon> photons = std::move(this->Photons); this->Clear(); return photons; }
+	void SetType(MapType type) { this->type = type; }
+	MapType GetType() const { return this->type; }
+	void SetCompact(bool compact) { this->compact = compact; }
+	bool IsCompact() const { return this->compact; }
 	void push_back(const Photon& photon) { this->Photons.push_back(photon); }
-	int GetSize() const { return this->Photons.size(); }
-	Photon& operator[] (size_t i) { return this->Photons[i]; }
-	void Clear() { this->Photons.clear(); this->kdtree.Clear(); }
+	int GetSize() const { return this->compact? this->CompactPhotons.size() : this->Photons.size(); }
+	// Size of the photons searched by the queries
+	size_t GetPhotonBytes() const { return this->compact? sizeof(CompactPhoton) : sizeof(Photon); }
+	Photon operator[] (size_t i) const { return this->compact? this->CompactPhotons[i].Decode() : this->Photons[i]; }
+	void Clear() 
+	{ 
+		this->Photons.clear(); 
+		this->CompactPhotons.clear(); 
+		this->kdtree.Clear(); 
+		this->grid.Clear(); 
+		this->CompactKdtree.Clear(); 
+		this->CompactGrid.Clear(); 
+	}
 
-	void Build()
+	// radius is the gather radius of the coming pass, the grid uses cells twice as wide
+	// so a fixed-radius query visits at most 2x2x2 cells
+	void Build(float radius)
+	{
+		if (this->compact)
+		{
+			this->CompactPhotons.resize(this->Photons.size());
+			#pragma omp parallel for
+			for (size_t i = 0; i < this->Photons.size(); i++)
+				this->CompactPhotons[i] = CompactPhoton(this->Photons[i]);
+			std::vector<Photon>().swap(this->Photons);
+			if (this->type == MapType::HASHGRID)
+			{
+				this->CompactGrid.Set(this->CompactPhotons.data(), this->CompactPhotons.size());
+				this->CompactGrid.Build(2 * radius);
+			}
+			else
+			{
+				this->CompactKdtree.Set(this->CompactPhotons.data(), this->CompactPhotons.size());
+				this->CompactKdtree.Build();
+			}
+			return;
+		}
+		if (this->type == MapType::HASHGRID)
+		{
+			this->grid.Set(this->Photons.data(), this->Photons.size());
+			this->grid.Build(2 * radius);
+		}
+		else
+		{
+			this->kdtree.Set(this->Photons.data(), this->Photons.size());
+			this->kdtree.Build();
+		}
+	}
+
+	// visit(photon) is called with each of the k nearest photons, returns the largest squared distance
+	template <typename Visitor>
+	float VisitKNN(const Vector3f& target, int k, Visitor&& visit)
 	{
-		this->kdtree.Clear();
-		this->kdtree.Set(this->Photons.data(), this->Photons.size());
-		this->kdtree.Build();
+		auto full = [&](const Photon& photon, int idx) { visit(photon); };
+		auto compact = [&](const CompactPhoton& photon, int idx) { visit(photon.Decode()); };
+		if (this->compact)
+		{
+			if (this->type == MapType::HASHGRID)
+				return this->CompactGrid.SearchKNN(target, k, compact);
+			return this->CompactKdtree.SearchKNN(target, k, compact);
+		}
+		if (this->type == MapType::HASHGRID)
+			return this->grid.SearchKNN(target, k, full);
+		return this->kdtree.SearchKNN(target, k, full);
+	}
+
+	// visit(photon) is called with each photon closer than sqrt(radius2), without collecting them first
+	template <typename Visitor>
+	void VisitNIR(const Vector3f& target, float radius2, Visitor&& visit)
+	{
+		auto full = [&](const Photon& photon, int idx) { visit(photon); };
+		auto compact = [&](const CompactPhoton& photon, int idx) { visit(photon.Decode()); };
+		if (this->compact)
+		{
+			if (this->type == MapType::HASHGRID)
+				this->CompactGrid.SearchNIR(target, radius2, compact);
+			else
+				this->CompactKdtree.SearchNIR(target, radius2, compact);
+		}
+		else if (this->type == MapType::HASHGRID)
+			this->grid.SearchNIR(target, radius2, full);
+		else
+			this->kdtree.SearchNIR(target, radius2, full);
 	}
 
+	// Index lists of the queries above, for callers that need to keep the result
 	float QueryKNN(const Vector3f& target, int k, std::vector<int>& result)
 	{
-		return this->kdtree.SearchKNN(target, k, result);
+		result.clear();
+		auto collect = [&](const auto& photon, int idx) { result.push_back(idx); };
+		if (this->compact)
+		{
+			if (this->type == MapType::HASHGRID)
+				return this->CompactGrid.SearchKNN(target, k, collect);
+			return this->CompactKdtree.SearchKNN(target, k, collect);
+		}
+		if (this->type == MapType::HASHGRID)
+			return this->grid.SearchKNN(target, k, collect);
+		return this->kdtree.SearchKNN(target, k, collect);
 	}
 
 	int QueryNIR(const Vector3f& target, float radius2, std::vector<int>& result)
 	{
-		return this->kdtree.SearchNIR(target, radius2, result);
+		auto collect = [&](const auto& photon, int idx) { result.push_back(idx); };
+		if (this->compact)
+		{
+			if (this->type == MapType::HASHGRID)
+				this->CompactGrid.SearchNIR(target, radius2, collect);
+			else
+				this->CompactKdtree.SearchNIR(target, radius2, collect);
+		}
+		else if (this->type == MapType::HASHGRID)
+			this->grid.SearchNIR(target, radius2, collect);
+		else
+			this->kdtree.SearchNIR(target, radius2, collect);
+		return result.size();
 	}
 };
 #endif
\ No newline at end of file
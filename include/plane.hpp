@@ -48,17 +48,22 @@ public:
 		if (t < tmin || t >= h.getT())
 			return false;
 
+		h.record(t, this->material, this);
+		return true;
+	}
+
+	HitSurface GetSurface(const Ray &r, const Hit &h, int level) const override
+	{
+		float t = h.getT();
 		if (this->HasTexture && this->material->HasTexture())
 		{
 			Vector3f pos = r.GetAt(t) - this->origin;
 			float E = this->e[0].squaredLength() * this->e[1].squaredLength() - Vector3f::dot(this->e[0], this->e[1]) * Vector3f::dot(this->e[0], this->e[1]);
 			float S1 = Vector3f::dot(pos, this->e[0]) * this->e[1].squaredLength() - Vector3f::dot(this->e[0], this->e[1]) * Vector3f::dot(pos, this->e[1]);
 			float S2 = Vector3f::dot(pos, this->e[1]) * this->e[0].squaredLength() - Vector3f::dot(this->e[0], this->e[1]) * Vector3f::dot(pos, this->e[0]); 
-			h.set(t, this->material, HitSurface(r.GetAt(t), this->normal, this->normal, Vector2f(S1 / E, S2 / E), true));
+			return HitSurface(r.GetAt(t), this->normal, this->normal, Vector2f(S1 / E, S2 / E), true);
 		}
-		else
-			h.set(t, this->material, HitSurface(r.GetAt(t), this->normal));
-		return true;
+		return HitSurface(r.GetAt(t), this->normal);
 	}
 
 	HitSurface SamplePoint(double &pdf, RandomGenerator &rng) const override
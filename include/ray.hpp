@@ -14,13 +14,10 @@ public:
 	{
 		origin = orig;
 		direction = dir;
+		Precompute();
 	}
 
-	Ray(const Ray &r)
-	{
-		origin = r.origin;
-		direction = r.direction;
-	}
+	Ray(const Ray &r) = default;
 
 	const Vector3f &getOrigin() const
 	{
@@ -32,14 +29,49 @@ public:
 		return direction;
 	}
 
+	// Cached per ray so that primitive and box tests need no sqrt or divide of their own
+	const Vector3f &getUnitDirection() const
+	{
+		return unit;
+	}
+
+	float getLength() const
+	{
+		return length;
+	}
+
+	const Vector3f &getInvDirection() const
+	{
+		return inv;
+	}
+
+	// 1 when the direction is negative along axis
+	int getSign(int axis) const
+	{
+		return sign[axis];
+	}
+
 	Vector3f GetAt(float t) const
 	{
 		return origin + direction * t;
 	}
 
 private:
+	void Precompute()
+	{
+		length = direction.length();
+		unit = Vector3f(direction[0] / length, direction[1] / length, direction[2] / length);
+		inv = Vector3f(1.0f / direction[0], 1.0f / direction[1], 1.0f / direction[2]);
+		for (int i = 0; i < 3; i++)
+			sign[i] = inv[i] < 0;
+	}
+
 	Vector3f origin;
 	Vector3f direction;
+	Vector3f unit;
+	Vector3f inv;
+	float length;
+	unsigned char sign[3];
 };
 
 inline std::ostream &operator<<(std::ostream &os, const Ray &r)
@@ -29,8 +29,8 @@ public:
 		bool inside = true;
 		enum {LEFT, RIGHT, MIDDLE} pos[3];
 		Vector3f Candidate;
-		Vector3f origin = ray.getOrigin(), dir = ray.getDirection().normalized();
-		float length = ray.getDirection().length();
+		const Vector3f &origin = ray.getOrigin(), &dir = ray.getUnitDirection();
+		float length = ray.getLength();
 		for (int i = 0; i < 3; i++)
 		{
 			if (origin[i] < this->LowerLeftBehind[i] - std::max(0.0f, tmin * dir[i]))
@@ -70,7 +70,6 @@ public:
 			if (tmax / length < tmin || tmax / length > hit.getT())
 				return false;
 			Vector3f position = ray.GetAt(tmax / length);
-			Vector3f normal;
 			for (int i = 0; i < 3; i++)
 			{
 				if (maxIdx != i)
@@ -78,17 +77,9 @@ public:
 					if (position[i] < this->LowerLeftBehind[i] || position[i] > this->UpperRightFront[i])
 						return false;
 				}
-				else
-					normal[i] = (pos[i] == RIGHT)? 1 : -1;
 			}
 
-			if (this->material->HasTexture())
-			{
-				int face = maxIdx * 2 + ((normal[maxIdx] > 0)? 0 : 1);
-				hit.set(tmax / length, this->material, HitSurface(position, normal, normal, MapToUV(position, face), true));
-			}
-			else
-				hit.set(tmax / length, this->material, {position, normal});
+			hit.record(tmax / length, this->material, this, maxIdx * 2 + ((pos[maxIdx] == RIGHT)? 0 : 1));
 			return true;
 		}
 		else
@@ -108,20 +99,31 @@ public:
 			}
 			if (t / length < tmin || t / length > hit.getT())
 				return false;
-			Vector3f position = ray.GetAt(t / length);
-			Vector3f normal;
-			normal[minIdx] = (dir[minIdx] < 0)? -1 : 1;
-			if (this->material->HasTexture())
-			{
-				int face = minIdx * 2 + ((normal[minIdx] > 0)? 0 : 1);
-				hit.set(t / length, this->material, HitSurface(position, normal, normal, MapToUV(position, face), true));
-			}
-			else
-				hit.set(t / length, this->material, {position, normal});
+			hit.record(t / length, this->material, this, minIdx * 2 + ((dir[minIdx] < 0)? 1 : 0));
 			return true;
 		}
 	}
 
+	// The face of the hit is recorded as axis * 2, plus 1 for the lower side
+	HitSurface GetSurface(const Ray &ray, const Hit &hit, int level) const override
+	{
+		int face = hit.getPrim();
+		Vector3f position = ray.GetAt(hit.getT());
+		Vector3f normal;
+		normal[face / 2] = (face & 1)? -1 : 1;
+		if (this->material->HasTexture())
+			return HitSurface(position, normal, normal, MapToUV(position, face), true);
+		return {position, normal};
+	}
+
+	bool GetBounds(AABB &box) const override
+	{
+		box = AABB();
+		box.Expand(this->UpperRightFront);
+		box.Expand(this->LowerLeftBehind);
+		return true;
+	}
+
 	HitSurface SamplePoint(double &pdf, RandomGenerator &rng) const override
 	{
 		double area_xy, area_yz, area_zx;
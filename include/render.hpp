@@ -6,11 +6,94 @@
 #include "utils.hpp"
 #include "image.hpp"
 #include "hit.hpp"
+#include "tile_scheduler.hpp"
+#include "snapshot_writer.hpp"
 
 class PhotonMapping
 {
 private:
 	PhotonMap GlobalPM;
+	PhotonMap NextPM;		// Photon map of the next pass, traced and built while GlobalPM is gathered
+	bool Pipeline = false;
+
+	struct alignas(64) PhotonBuffer		// Per-thread photon storage, aligned to avoid false sharing
+	{
+		std::vector<Photon> photons;
+	};
+	std::vector<PhotonBuffer> PhotonBuffers;
+
+	struct HitPoint		// Camera path ending on a diffuse surface, waiting for its photon gather
+	{
+		Material* material;
+		HitSurface surface;
+		Vector3f dir;		// Direction of the camera ray arriving at the hit
+		Vector3f weight;	// Path throughput up to the hit
+		Vector3f color;		// Emitted radiance at the hit, or the whole result when no gather is needed
+		bool gather;
+		int found;			// Photons found by the gather
+	};
+	std::vector<HitPoint> HitPoints;
+	std::vector<std::pair<uint64_t, size_t>> GatherOrder;
+	bool BatchGather = false;
+	const int BatchSize = 1 << 20;		// Max number of camera paths in a batch
+	const int TileSize = 16;			// Side of the square pixel tiles handed to the gather threads
+
+	struct VisiblePoint		// Diffuse camera hit of the current SPPM iteration
+	{
+		Vector3f pos;
+		Vector3f normal;
+		Vector3f tangent;
+		Vector3f binormal;
+		Vector3f in;		// Direction towards the camera in the local frame
+		Vector3f weight;	// Path throughput including the texture at the hit
+		Material* material;
+		int pixel;
+	};
+	struct SPPMPixel		// Per-pixel statistics of stochastic progressive photon mapping
+	{
+		float radius;
+		float N;			// Accumulated photon count
+		int M;				// Photons found in the current iteration
+		Vector3f tau;		// Accumulated flux, scaled to the current radius
+		float phi[3];		// Flux found in the current iteration, updated atomically
+		Vector3f direct;	// Sum of the radiance that is not estimated from photons
+	};
+	std::vector<VisiblePoint> VisiblePoints;
+	std::vector<SPPMPixel> Pixels;
+	HashGrid<VisiblePoint> VisibleGrid;
+	bool SPPM = false;
+
+	struct PixelRadius		// Gather radius and accumulated photon count of a pixel
+	{
+		float radius;
+		float N;
+	};
+	std::vector<PixelRadius> Radii;
+	bool AdaptiveRadius = false;
+
+	struct PathState		// Path in flight in the wavefront tracer
+	{
+		Vector3f origin;
+		Vector3f dir;
+		Vector3f power;		// Photon power, or camera path throughput
+		Hit hit;			// Closest hit of the last extend, its surface is built when the path is shaded
+		bool isLight;
+		int LightIdx;
+		size_t slot;		// Hit point written by a camera path
+		bool active;		// Cleared once the path terminates
+	};
+	struct PathQueue		// Paths of one wavefront, camera and photon paths have their own since they may run concurrently
+	{
+		std::vector<PathState> paths;
+		std::vector<PathState> next;
+		std::vector<std::pair<uint64_t, size_t>> order;		// (material and direction octant, path) of the hits of a bounce
+	};
+	PathQueue CameraQueue;
+	PathQueue PhotonQueue;
+	bool Wavefront = false;
+
+	int SnapshotInterval = 1;
+	double SnapshotPeriod = 0.0;
 
 	int nPhoton;
 	int iter;
@@ -19,11 +102,39 @@ private:
 	float SearchRadius;
 	float alpha;
 
-	void BuildPM(SceneParser& scene, std::vector<RandomGenerator>& rng);
-	Vector3f GetPhotonRadiance(const Vector3f& v, const Hit& hit, SceneParser& scene, RandomGenerator& rng);
-	Vector3f GetRadiance(const Ray& r, SceneParser& scene, RandomGenerator& rng);
+	template <typename Miss, typename Shade>
+	void RunWavefront(PathQueue& queue, SceneParser& scene, std::vector<RandomGenerator>& rng_list, Miss&& miss, Shade&& shade);
+	template <typename Deposit>
+	void TracePhotonsWavefront(SceneParser& scene, std::vector<RandomGenerator>& rng_list, Deposit&& deposit);
+	template <typename Deposit>
+	void TracePhotons(SceneParser& scene, std::vector<RandomGenerator>& rng_list, Deposit&& deposit);
+	void BuildPM(SceneParser& scene, std::vector<RandomGenerator>& rng_list, PhotonMap& pm, float radius);
+	Vector3f GetPhotonRadiance(const Vector3f& v, Material* material, const HitSurface& surface, float radius, int& found, SceneParser& scene, RandomGenerator& rng);
+	Vector3f GetRadiance(const Ray& r, float radius, int& found, SceneParser& scene, RandomGenerator& rng);
+	float GetGatherRadius(int pixel) const { return this->AdaptiveRadius? this->Radii[pixel].radius : this->SearchRadius; }
+	void UpdateRadius(int pixel, float M);
+	bool TraceCameraPath(const Ray& r, SceneParser& scene, RandomGenerator& rng, HitPoint& hp);
+	template <typename Sampler>
+	void TraceCameraPaths(SceneParser& scene, std::vector<RandomGenerator>& rng_list, size_t count, Sampler&& sample);
+	void GatherPixels(SceneParser& scene, std::vector<RandomGenerator>& rng_list, std::vector<Vector3f>& img, int Width, int Height);
+	void GatherBatched(SceneParser& scene, std::vector<RandomGenerator>& rng_list, std::vector<Vector3f>& img, int Width, int Height);
+	void ToneMap(const std::vector<Vector3f>& img, float scale, float gamma, Image& image);
+	void IterateSPPM(SceneParser& scene, std::vector<RandomGenerator>& rng_list, std::vector<Vector3f>& img, int Width, int Height);
 public:
 	PhotonMapping(int n, int i, int d, int nrays, float r, float a) : nPhoton(n), iter(i), Depth(d), nRays(nrays), SearchRadius(r), alpha(a) {}
+	void SetMapType(MapType type) { this->GlobalPM.SetType(type); this->NextPM.SetType(type); }
+	void SetCompactPhotons(bool compact) { this->GlobalPM.SetCompact(compact); this->NextPM.SetCompact(compact); }
+	void SetBatchGather(bool batch) { this->BatchGather = batch; }
+	// Splat photons into per-pixel visible points instead of building a photon map
+	void SetSPPM(bool sppm) { this->SPPM = sppm; }
+	// Shrink a separate gather radius for every pixel instead of one global radius
+	void SetAdaptiveRadius(bool adaptive) { this->AdaptiveRadius = adaptive; }
+	// Trace camera and photon paths a bounce at a time over queues sorted by material, implies batched gathers
+	void SetWavefront(bool wavefront) { this->Wavefront = wavefront; }
+	// Trace and build the photon map of the next pass on part of the threads while the current pass is gathered
+	void SetPipeline(bool pipeline) { this->Pipeline = pipeline; }
+	// Save tmp/<iteration>.bmp every interval iterations but at most once per period seconds, interval 0 disables it
+	void SetSnapshot(int interval, double period) { this->SnapshotInterval = interval; this->SnapshotPeriod = period; }
 	void Render(SceneParser& scene, Image& image);
 };
 #endif
\ No newline at end of file
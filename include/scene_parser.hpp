@@ -2,6 +2,9 @@
 #define SCENE_PARSER_H
 
 #include <cassert>
+#include <map>
+#include <string>
+#include <memory>
 #include <vecmath.h>
 #include "material.hpp"
 #include "group.hpp"
@@ -23,7 +26,8 @@ class SceneParser
 {
 public:
 	SceneParser() = delete;
-	SceneParser(const char *filename);
+	// Meshes are loaded with the given acceleration structure, and with quantized vertices if asked
+	SceneParser(const char *filename, MeshAccel accel = MeshAccel::WIDE_BVH, bool QuantizeMeshes = false);
 
 	~SceneParser();
 
@@ -69,21 +73,24 @@ public:
 		return group;
 	}
 
+	// Light geometry is part of the group, see addEmitters(). The surface of the hit is built by
+	// h.finalize(r), only where it is needed
 	bool intersect(const Ray &r, Hit &h, float tmin, bool& isLight, int& LightIdx) const
 	{
-		bool ObjIntersect = this->group->intersect(r, h, tmin);
-		isLight = false;
-		for (int i = 0; i < this->num_lights; i++)
-		{
-			isLight |= this->lights[i]->intersect(r, h, tmin);
-			if (isLight)
-				LightIdx = i;
-		}
-		return isLight | ObjIntersect;
+		bool result = this->group->intersect(r, h, tmin);
+		isLight = result && h.getLight() >= 0;
+		if (isLight)
+			LightIdx = h.getLight();
+		return result;
 	}
 
+	// Pose the animated transforms and meshes at the given frame and update the BVHs over them, by a
+	// Morton-code rebuild or a refit. Returns false for a scene without animation
+	bool SetFrame(int frame, bool rebuild);
+
 private:
 	void parseFile();
+	void addEmitters();
 
 	void parsePerspectiveCamera();
 	void parseLensCamera();
@@ -110,6 +117,7 @@ private:
 	Triangle *parseTriangle();
 	Mesh *parseTriangleMesh();
 	Transform *parseTransform();
+	bool parseTransformation(char token[MAX_PARSER_TOKEN_LENGTH], Matrix4f &matrix);
 
 	int getToken(char token[MAX_PARSER_TOKEN_LENGTH]);
 
@@ -128,6 +136,26 @@ private:
 	Material **materials;
 	Material *current_material;
 	Group *group;
+	MeshAccel accel;
+	bool QuantizeMeshes;
+	std::map<std::string, std::shared_ptr<const MeshData>> meshes;	// OBJ file -> geometry shared by its instances
+
+	// A Transform placed by matrix * motion^frame
+	struct AnimatedTransform
+	{
+		Transform *transform;
+		Matrix4f matrix;
+		Matrix4f motion;
+	};
+	// A mesh reading the vertices of each frame from its own OBJ file
+	struct AnimatedMesh
+	{
+		std::shared_ptr<MeshData> data;
+		std::string frames;		// Path with a run of '#' replaced by the zero-padded frame number
+	};
+	std::vector<AnimatedTransform> AnimatedTransforms;
+	std::vector<AnimatedMesh> AnimatedMeshes;
+	std::vector<Group *> groups;	// Every group, nested ones before the group holding them
 };
 
 #endif // SCENE_PARSER_H
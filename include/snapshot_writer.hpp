@@ -0,0 +1,100 @@
+#ifndef SNAPSHOT_WRITER_H
+#define SNAPSHOT_WRITER_H
+
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <omp.h>
+#include "image.hpp"
+#include "utils.hpp"
+
+// Saves progressive snapshots on a background thread. The renderer tone-maps into GetBuffer()
+// and calls Submit(), which swaps the buffer with the one owned by the writer. A snapshot is
+// dropped instead of waited for when the previous one is still being written, unless the caller
+// asks to wait
+class SnapshotWriter
+{
+private:
+	std::unique_ptr<Image> Front;	// Filled by the renderer
+	std::unique_ptr<Image> Back;	// Saved by the writer thread
+	std::string Path;
+	bool Busy = false;
+	bool Stop = false;
+	std::mutex lock;
+	std::condition_variable cv;
+	std::thread writer;
+
+	int Interval;			// Snapshot every Interval iterations, 0 disables the snapshots
+	double Period;			// Minimum seconds between snapshots, 0 for no limit
+	double LastTime;
+
+	void Run()
+	{
+		std::unique_lock<std::mutex> guard(this->lock);
+		while (true)
+		{
+			this->cv.wait(guard, [this]() { return this->Busy || this->Stop; });
+			if (!this->Busy)
+				return;
+			guard.unlock();
+			this->Back->SaveBMP(this->Path.c_str());
+			guard.lock();
+			this->Busy = false;
+			this->cv.notify_all();
+		}
+	}
+
+public:
+	SnapshotWriter(int Width, int Height, int Interval = 1, double Period = 0.0)
+		: Front(new Image(Width, Height)), Back(new Image(Width, Height)), Interval(Interval), Period(Period), LastTime(omp_get_wtime() - Period)
+	{
+		if (this->Interval > 0)
+			this->writer = std::thread(&SnapshotWriter::Run, this);
+	}
+
+	~SnapshotWriter()
+	{
+		{
+			std::lock_guard<std::mutex> guard(this->lock);
+			this->Stop = true;
+		}
+		this->cv.notify_one();
+		if (this->writer.joinable())
+			this->writer.join();
+	}
+
+	// Whether the given iteration should be snapshotted, the last iteration always is
+	bool Due(int iteration, int nIterations) const
+	{
+		if (this->Interval <= 0)
+			return false;
+		if (iteration + 1 == nIterations)
+			return true;
+		return !((iteration + 1) % this->Interval) && omp_get_wtime() - this->LastTime >= this->Period;
+	}
+
+	Image& GetBuffer() { return *this->Front; }
+
+	// Hand the buffer to the writer thread, returns false if the snapshot was dropped. With wait set
+	// the previous snapshot is finished first, so this one is never dropped
+	bool Submit(const std::string& path, bool wait = false)
+	{
+		{
+			std::unique_lock<std::mutex> guard(this->lock);
+			if (wait)
+				this->cv.wait(guard, [this]() { return !this->Busy; });
+			if (this->Busy)
+				return false;
+			std::swap(this->Front, this->Back);
+			this->Path = path;
+			this->Busy = true;
+		}
+		this->LastTime = omp_get_wtime();
+		this->cv.notify_all();
+		return true;
+	}
+};
+
+#endif
@@ -30,7 +30,7 @@ public:
 	{
 		//
 		Vector3f l = this->center - r.getOrigin();
-		float tp = Vector3f::dot(l, r.getDirection().normalized());
+		float tp = Vector3f::dot(l, r.getUnitDirection());
 		float d_sqr = l.squaredLength() - tp * tp;
 
 		if (d_sqr > this->radius * this->radius)
@@ -49,7 +49,23 @@ public:
 		if (t < tmin || t >= h.getT())
 			return false;
 
-		h.set(t, this->material, {r.GetAt(t), (r.GetAt(t) - this->center).normalized()});
+		h.record(t, this->material, this);
+		return true;
+	}
+
+	HitSurface GetSurface(const Ray &r, const Hit &h, int level) const override
+	{
+		Vector3f position = r.GetAt(h.getT());
+		return {position, (position - this->center).normalized()};
+	}
+
+	bool GetBounds(AABB &box) const override
+	{
+		for (int i = 0; i < 3; i++)
+		{
+			box.min[i] = this->center[i] - this->radius;
+			box.max[i] = this->center[i] + this->radius;
+		}
 		return true;
 	}
 
@@ -0,0 +1,103 @@
+#ifndef TILE_SCHEDULER_H
+#define TILE_SCHEDULER_H
+
+#include <vector>
+#include <mutex>
+#include <algorithm>
+#include "utils.hpp"
+
+struct Tile		// Pixels [x0, x1) x [y0, y1)
+{
+	int x0, y0;
+	int x1, y1;
+};
+
+// Square tiles visited in Morton order, every thread owns a contiguous run of them
+// and steals half of another thread's run once its own is done
+class TileScheduler
+{
+private:
+	struct alignas(64) TileQueue	// Tiles [begin, end) of the Morton ordered list
+	{
+		std::mutex lock;
+		int begin = 0;
+		int end = 0;
+	};
+
+	std::vector<Tile> Tiles;
+	std::vector<TileQueue> Queues;
+
+	bool Steal(int tid)
+	{
+		int nQueues = this->Queues.size();
+		for (int i = 1; i < nQueues; i++)
+		{
+			TileQueue& victim = this->Queues[(tid + i) % nQueues];
+			int begin, end;
+			{
+				std::lock_guard<std::mutex> guard(victim.lock);
+				int remain = victim.end - victim.begin;
+				if (remain <= 0)
+					continue;
+				end = victim.end;
+				begin = victim.end - (remain + 1) / 2;
+				victim.end = begin;
+			}
+			TileQueue& own = this->Queues[tid];
+			std::lock_guard<std::mutex> guard(own.lock);
+			own.begin = begin;
+			own.end = end;
+			return true;
+		}
+		return false;
+	}
+
+public:
+	TileScheduler(int Width, int Height, int TileSize, int nThreads) : Queues(std::max(nThreads, 1))
+	{
+		std::vector<std::pair<uint64_t, Tile>> order;
+		for (int x = 0; x < Width; x += TileSize)
+			for (int y = 0; y < Height; y += TileSize)
+				order.push_back({MortonCode(x / TileSize, y / TileSize, 0), Tile{x, y, std::min(x + TileSize, Width), std::min(y + TileSize, Height)}});
+		std::sort(order.begin(), order.end(), [](const auto& a, const auto& b) { return a.first < b.first; });
+		for (auto& p : order)
+			this->Tiles.push_back(p.second);
+		this->Reset();
+	}
+
+	// Hand out every tile again, split evenly between the threads
+	void Reset()
+	{
+		int nQueues = this->Queues.size();
+		int nTiles = this->Tiles.size();
+		for (int i = 0; i < nQueues; i++)
+		{
+			std::lock_guard<std::mutex> guard(this->Queues[i].lock);
+			this->Queues[i].begin = (long long)nTiles * i / nQueues;
+			this->Queues[i].end = (long long)nTiles * (i + 1) / nQueues;
+		}
+	}
+
+	int GetNumTiles() const { return this->Tiles.size(); }
+
+	// Next tile of thread tid, returns false once no thread has tiles left
+	bool Next(int tid, Tile& tile)
+	{
+		while (true)
+		{
+			{
+				TileQueue& own = this->Queues[tid];
+				std::lock_guard<std::mutex> guard(own.lock);
+				if (own.begin < own.end)
+				{
+					tile = this->Tiles[own.begin++];
+					return true;
+				}
+			}
+			if (!this->Steal(tid))
+				return false;
+		}
+	}
+};
+
+#endif
@@ -20,21 +20,60 @@ public:
 	{
 	}
 
+	// Object to world matrix, changed between the frames of an animation
+	void SetMatrix(const Matrix4f &m)
+	{
+		transform = m.inverse();
+	}
+
 	virtual bool intersect(const Ray &r, Hit &h, float tmin) const override
 	{
 		Vector3f trSource = transformPoint(transform, r.getOrigin());
 		Vector3f trDirection = transformDirection(transform, r.getDirection());
 		Ray tr(trSource, trDirection);
 		bool inter = o->intersect(tr, h, tmin);
-		if (inter)
+		// Nested deeper than a hit can record, this transform stands in for the objects below it
+		if (inter && !h.pushObject(this))
+			h.restart(this);
+		return inter;
+	}
+
+	// The normals are only brought back to world space for the closest hit
+	HitSurface GetSurface(const Ray &r, const Hit &h, int level) const override
+	{
+		Ray tr(transformPoint(transform, r.getOrigin()), transformDirection(transform, r.getDirection()));
+		HitSurface s;
+		if (level + 1 < h.getDepth())
+			s = h.getSurfaceAt(tr, level + 1);
+		else
 		{
-			h.set(h.getT(), h.getMaterial(), HitSurface(r.GetAt(h.getT()),
-									 transformDirection(transform.transposed(), h.getSurface().normal).normalized(),
-									 transformDirection(transform.transposed(), h.getSurface().geonormal).normalized(),
-									 h.getSurface().texcoord,
-									 h.getSurface().HasTexture));
+			// The chain was restarted here, find the same hit below this transform again
+			Hit inner(std::nextafter(h.getT(), INFINITY));
+			o->intersect(tr, inner, std::nextafter(h.getT(), -INFINITY));
+			s = inner.finalize(tr);
 		}
-		return inter;
+		Matrix4f normalMatrix = transform.transposed();
+		return HitSurface(r.GetAt(h.getT()),
+						  transformDirection(normalMatrix, s.normal).normalized(),
+						  transformDirection(normalMatrix, s.geonormal).normalized(),
+						  s.texcoord,
+						  s.HasTexture);
+	}
+
+	// Box around the transformed corners of the object's box
+	bool GetBounds(AABB &box) const override
+	{
+		AABB local;
+		if (!o->GetBounds(local))
+			return false;
+		Matrix4f forward = this->transform.inverse();
+		box = AABB();
+		for (int i = 0; i < 8; i++)
+		{
+			Vector3f corner((i & 1)? local.max[0] : local.min[0], (i & 2)? local.max[1] : local.min[1], (i & 4)? local.max[2] : local.min[2]);
+			box.Expand(transformPoint(forward, corner));
+		}
+		return true;
 	}
 
 	HitSurface SamplePoint(double &pdf, RandomGenerator &rng) const override
@@ -42,37 +42,56 @@ public:
 		this->HasTexture = true;
 	}
 
-	bool intersect(const Ray &ray, Hit &hit, float tmin) const override
+	// Test against the triangle abc without building a surface, on a hit closer than t it is lowered
+	// to the hit and beta, gamma are set to the barycentrics of b and c
+	static bool Intersect(const Vector3f &a, const Vector3f &b, const Vector3f &c, const Ray &ray, float tmin, float &t, float &beta, float &gamma)
 	{
-		Vector3f E1 = this->vertices[0] - this->vertices[1];
-		Vector3f E2 = this->vertices[0] - this->vertices[2];
-		Vector3f S = this->vertices[0] - ray.getOrigin();
+		Vector3f E1 = a - b;
+		Vector3f E2 = a - c;
+		Vector3f S = a - ray.getOrigin();
 
 		float det1 = Matrix3f(ray.getDirection(), E1, E2).determinant();
 		if (abs(det1) < 1e-6)
 			return false;
 
-		float t = Matrix3f(S, E1, E2).determinant() / det1;
-		if (t < 0)
+		float dist = Matrix3f(S, E1, E2).determinant() / det1;
+		if (dist < 0)
 			return false;
-		if (t < tmin || t >= hit.getT())
+		if (dist < tmin || dist >= t)
 			return false;
 
-		float beta = Matrix3f(ray.getDirection(), S, E2).determinant() / det1;
-		if (beta < 0 || beta > 1)
+		float b1 = Matrix3f(ray.getDirection(), S, E2).determinant() / det1;
+		if (b1 < 0 || b1 > 1)
+			return false;
+		float b2 = Matrix3f(ray.getDirection(), E1, S).determinant() / det1;
+		if (b2 < 0 || b2 > 1 || b1 + b2 > 1)
 			return false;
-		float gamma = Matrix3f(ray.getDirection(), E1, S).determinant() / det1;
-		if (gamma < 0 || gamma > 1 || beta + gamma > 1)
+
+		t = dist;
+		beta = b1;
+		gamma = b2;
+		return true;
+	}
+
+	bool intersect(const Ray &ray, Hit &hit, float tmin) const override
+	{
+		float t = hit.getT(), beta, gamma;
+		if (!Intersect(this->vertices[0], this->vertices[1], this->vertices[2], ray, tmin, t, beta, gamma))
 			return false;
+		hit.record(t, this->material, this, 0, beta, gamma);
+		return true;
+	}
 
+	HitSurface GetSurface(const Ray &ray, const Hit &hit, int level) const override
+	{
+		float beta = hit.getU(), gamma = hit.getV();
 		Vector3f norm = (1 - beta - gamma) * this->normal[0] + beta * this->normal[1] + gamma * this->normal[2];
 		Vector2f tex;
 		if (this->HasTexture && this->material->HasTexture())
 		{
 			tex = (1 - beta - gamma) * this->texcoord[0] + beta * this->texcoord[1] + gamma * this->texcoord[2];
 		}
-		hit.set(t, this->material, HitSurface(ray.GetAt(t), norm, this->geonormal, tex, this->HasTexture && this->material->HasTexture()));
-		return true;
+		return HitSurface(ray.GetAt(hit.getT()), norm, this->geonormal, tex, this->HasTexture && this->material->HasTexture());
 	}
 
 	HitSurface SamplePoint(double &pdf, RandomGenerator &rng) const override
@@ -94,6 +113,14 @@ public:
 		return HitSurface(pos, norm, this->geonormal, tex, this->HasTexture && this->material->HasTexture());
 	}
 
+	bool GetBounds(AABB &box) const override
+	{
+		box = AABB();
+		for (int i = 0; i < 3; i++)
+			box.Expand(this->vertices[i]);
+		return true;
+	}
+
 	Vector3f GetGeonormal() {return this->geonormal;}
 
 protected:
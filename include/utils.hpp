@@ -70,5 +70,8 @@ Vector3f Refract(const Vector3f& v, const Vector3f& n, float ior1, float ior2);
 
 bool CheckValid(const Vector3f& v);
 
+// Interleave the lower 21 bits of the three coordinates
+uint64_t MortonCode(unsigned x, unsigned y, unsigned z);
+
 
 #endif
\ No newline at end of file
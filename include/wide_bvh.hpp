@@ -0,0 +1,258 @@
+#ifndef WIDE_BVH_H
+#define WIDE_BVH_H
+
+#include <vector>
+#include <cmath>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <cassert>
+#include "bvh.hpp"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define WIDE_BVH_X86
+#endif
+
+// Node of a wide BVH, the boxes of all children are stored per axis so that one SIMD register
+// holds the same plane of every child. Unused slots have an empty box and are never entered
+template <int W>
+struct WideNode
+{
+	float bmin[3][W];
+	float bmax[3][W];
+	int child[W];				// First primitive of a leaf, node index of an interior child, -1 if unused
+	unsigned short count[W];	// Primitives of a leaf, 0 for interior children
+
+	int Child(int i) const { return this->child[i]; }
+	int Count(int i) const { return this->count[i]; }
+};
+
+// Wide node with the child boxes quantized to 8 bits inside the box of the node, a child spans
+// origin + qmin * scale to origin + qmax * scale. The scale of each axis is a power of two kept
+// as a biased float exponent, so q * scale is exact. Bounds are rounded outwards, unused slots
+// have qmin above qmax. Child index and leaf size share one word, 96 bytes at W = 8
+template <int W>
+struct QuantizedWideNode
+{
+	static const int CountBits = 4;		// Leaves hold at most 15 primitives
+	static const int MaxChild = (1 << (31 - CountBits)) - 1;
+	static const int Unused = -(1 << CountBits);		// Child -1, count 0
+
+	float origin[3];
+	unsigned char exponent[3];	// scale = 2^(exponent - 127)
+	unsigned char qmin[3][W];
+	unsigned char qmax[3][W];
+	int link[W];				// Child << CountBits | count, Unused if the slot is empty
+
+	float Scale(int axis) const
+	{
+		uint32_t bits = (uint32_t)this->exponent[axis] << 23;
+		float scale;
+		std::memcpy(&scale, &bits, sizeof(scale));
+		return scale;
+	}
+	int Child(int i) const { return this->link[i] >> CountBits; }
+	int Count(int i) const { return this->link[i] & ((1 << CountBits) - 1); }
+};
+
+// Ray of a wide traversal, inv holds the reciprocals of the direction
+struct WideRay
+{
+	float org[3], dir[3], inv[3];
+	float tmin, tmax;
+};
+
+// Closest hit found so far, slot is the leaf order position of the triangle or -1
+struct WideHit
+{
+	int slot = -1;
+	float beta = 0.0f, gamma = 0.0f;
+};
+
+// Widest node and vector, the triangle records are padded by this many entries
+const int MaxWideWidth = 8;
+
+// Triangle records in leaf order, padded with MaxWideWidth zero triangles so that full vectors can be loaded
+struct TriangleView
+{
+	const float* v0[3];
+	const float* e1[3];
+	const float* e2[3];
+};
+
+// Closest-hit kernels, the 8-wide one lives in its own translation unit built with AVX2.
+// They lower ray.tmax to the distance of the hit and return whether one was found
+#ifdef WIDE_BVH_X86
+bool IntersectWide4(const WideNode<4>* nodes, const TriangleView& tri, WideRay& ray, WideHit& hit);
+bool IntersectWide8(const WideNode<8>* nodes, const TriangleView& tri, WideRay& ray, WideHit& hit);
+bool IntersectWide4(const QuantizedWideNode<4>* nodes, const TriangleView& tri, WideRay& ray, WideHit& hit);
+bool IntersectWide8(const QuantizedWideNode<8>* nodes, const TriangleView& tri, WideRay& ray, WideHit& hit);
+#endif
+bool CpuHasAVX2();
+
+// Wide BVH made by collapsing a binary BVHTree, leaves keep the primitive ranges of the binary tree.
+// Quantize() replaces the nodes by their compressed form
+template <int W>
+class WideBVH
+{
+private:
+	std::vector<WideNode<W>> Nodes;
+	std::vector<QuantizedWideNode<W>> QuantizedNodes;
+
+	static float Dequantize(const QuantizedWideNode<W>& node, int axis, int q)
+	{
+		return node.origin[axis] + q * node.Scale(axis);
+	}
+
+	int Collapse(const std::vector<BVHTree::Node>& binary, int idx)
+	{
+		// Open the largest interior child until W children are gathered
+		int slots[W] = {binary[idx].offset, binary[idx].offset + 1};
+		int n = 2;
+		while (n < W)
+		{
+			int best = -1;
+			float BestArea = -1.0f;
+			for (int i = 0; i < n; i++)
+			{
+				const BVHTree::Node& node = binary[slots[i]];
+				if (node.count == 0 && node.box.Area() > BestArea)
+				{
+					best = i;
+					BestArea = node.box.Area();
+				}
+			}
+			if (best < 0)
+				break;
+			int opened = slots[best];
+			slots[best] = binary[opened].offset;
+			slots[n++] = binary[opened].offset + 1;
+		}
+
+		int widx = this->Nodes.size();
+		this->Nodes.emplace_back();
+		for (int i = 0; i < W; i++)
+		{
+			WideNode<W>& node = this->Nodes[widx];
+			AABB box = (i < n)? binary[slots[i]].box : AABB();
+			for (int j = 0; j < 3; j++)
+			{
+				node.bmin[j][i] = box.min[j];
+				node.bmax[j][i] = box.max[j];
+			}
+			node.child[i] = -1;
+			node.count[i] = 0;
+			if (i >= n)
+				continue;
+			const BVHTree::Node& child = binary[slots[i]];
+			if (child.count > 0)
+			{
+				node.child[i] = child.offset;
+				node.count[i] = child.count;
+			}
+			else
+			{
+				int sub = this->Collapse(binary, slots[i]);
+				this->Nodes[widx].child[i] = sub;		// Nodes may have been reallocated
+			}
+		}
+		return widx;
+	}
+
+public:
+	static const int Width = W;
+
+	void Build(const BVHTree& tree)
+	{
+		this->Nodes.clear();
+		this->QuantizedNodes.clear();
+		const std::vector<BVHTree::Node>& binary = tree.GetNodes();
+		if (binary.empty())
+			return;
+		if (binary[0].count > 0)
+		{
+			// A single leaf gets a root holding only that leaf
+			this->Nodes.emplace_back();
+			WideNode<W>& node = this->Nodes[0];
+			for (int i = 0; i < W; i++)
+			{
+				AABB box = i? AABB() : binary[0].box;
+				for (int j = 0; j < 3; j++)
+				{
+					node.bmin[j][i] = box.min[j];
+					node.bmax[j][i] = box.max[j];
+				}
+				node.child[i] = i? -1 : binary[0].offset;
+				node.count[i] = i? 0 : binary[0].count;
+			}
+			return;
+		}
+		this->Collapse(binary, 0);
+	}
+
+	void Quantize()
+	{
+		this->QuantizedNodes.resize(this->Nodes.size());
+		for (size_t k = 0; k < this->Nodes.size(); k++)
+		{
+			const WideNode<W>& node = this->Nodes[k];
+			QuantizedWideNode<W>& q = this->QuantizedNodes[k];
+			for (int j = 0; j < 3; j++)
+			{
+				float lo = INFINITY, hi = -INFINITY;
+				for (int i = 0; i < W; i++)
+				{
+					lo = std::min(lo, node.bmin[j][i]);
+					hi = std::max(hi, node.bmax[j][i]);
+				}
+				// Smallest power of two step whose 255 steps reach hi, the exponent stays a normal float
+				q.origin[j] = lo;
+				int exp = 1;
+				if (hi > lo)
+				{
+					std::frexp((hi - lo) / 255.0f, &exp);
+					exp = std::min(254, std::max(1, exp - 1 + 127));
+				}
+				q.exponent[j] = exp;
+				while (Dequantize(q, j, 255) < hi && q.exponent[j] < 254)
+					q.exponent[j]++;
+				float scale = q.Scale(j);
+
+				for (int i = 0; i < W; i++)
+				{
+					if (node.bmin[j][i] > node.bmax[j][i])
+					{
+						q.qmin[j][i] = 255;
+						q.qmax[j][i] = 0;
+						continue;
+					}
+					int qlo = 0, qhi = 255;
+					qlo = std::min(255, std::max(0, (int)std::floor((node.bmin[j][i] - lo) / scale)));
+					qhi = std::min(255, std::max(0, (int)std::ceil((node.bmax[j][i] - lo) / scale)));
+					// The division rounds, step outwards until the dequantized box holds the child
+					while (qlo > 0 && Dequantize(q, j, qlo) > node.bmin[j][i])
+						qlo--;
+					while (qhi < 255 && Dequantize(q, j, qhi) < node.bmax[j][i])
+						qhi++;
+					q.qmin[j][i] = qlo;
+					q.qmax[j][i] = qhi;
+				}
+			}
+			for (int i = 0; i < W; i++)
+			{
+				assert(node.count[i] < (1 << QuantizedWideNode<W>::CountBits) && node.child[i] <= QuantizedWideNode<W>::MaxChild);
+				q.link[i] = (node.child[i] < 0)? QuantizedWideNode<W>::Unused : (node.child[i] << QuantizedWideNode<W>::CountBits) | node.count[i];
+			}
+		}
+		std::vector<WideNode<W>>().swap(this->Nodes);
+	}
+
+	bool Empty() const { return this->Nodes.empty() && this->QuantizedNodes.empty(); }
+	bool Quantized() const { return !this->QuantizedNodes.empty(); }
+	int GetNumNodes() const { return this->Quantized()? this->QuantizedNodes.size() : this->Nodes.size(); }
+	size_t GetMemory() const { return this->Nodes.size() * sizeof(WideNode<W>) + this->QuantizedNodes.size() * sizeof(QuantizedWideNode<W>); }
+	const WideNode<W>* GetNodes() const { return this->Nodes.data(); }
+	const QuantizedWideNode<W>* GetQuantizedNodes() const { return this->QuantizedNodes.data(); }
+};
+
+#endif
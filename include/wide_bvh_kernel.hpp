@@ -0,0 +1,186 @@
+#ifndef WIDE_BVH_KERNEL_H
+#define WIDE_BVH_KERNEL_H
+
+// Closest-hit traversal of a WideBVH written once over a Lanes type that wraps the intrinsics
+// of one instruction set. Only included by src/wide_bvh.cpp (SSE) and src/wide_bvh_avx2.cpp
+// so that every instantiation is compiled for the instruction set it uses
+
+#include "wide_bvh.hpp"
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+
+namespace wide
+{
+
+static inline int LowestBit(unsigned mask)
+{
+#ifdef _MSC_VER
+	unsigned long idx;
+	_BitScanForward(&idx, mask);
+	return idx;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+// Test the triangles at leaf order positions [begin, begin + count), W at a time
+template <typename Lanes>
+bool IntersectLeaf(const TriangleView& tri, int begin, int count, WideRay& ray, WideHit& hit)
+{
+	typedef typename Lanes::V V;
+	const int W = Lanes::W;
+	const V dx = Lanes::Set(ray.dir[0]), dy = Lanes::Set(ray.dir[1]), dz = Lanes::Set(ray.dir[2]);
+	const V zero = Lanes::Set(0.0f), one = Lanes::Set(1.0f), eps = Lanes::Set(1e-6f);
+	bool found = false;
+	for (int base = 0; base < count; base += W)
+	{
+		const int i = begin + base;
+		V e1x = Lanes::Load(tri.e1[0] + i), e1y = Lanes::Load(tri.e1[1] + i), e1z = Lanes::Load(tri.e1[2] + i);
+		V e2x = Lanes::Load(tri.e2[0] + i), e2y = Lanes::Load(tri.e2[1] + i), e2z = Lanes::Load(tri.e2[2] + i);
+		V px = Lanes::Sub(Lanes::Mul(dy, e2z), Lanes::Mul(dz, e2y));
+		V py = Lanes::Sub(Lanes::Mul(dz, e2x), Lanes::Mul(dx, e2z));
+		V pz = Lanes::Sub(Lanes::Mul(dx, e2y), Lanes::Mul(dy, e2x));
+		V det = Lanes::Add(Lanes::Add(Lanes::Mul(e1x, px), Lanes::Mul(e1y, py)), Lanes::Mul(e1z, pz));
+		V inv = Lanes::Div(one, det);
+		V sx = Lanes::Sub(Lanes::Set(ray.org[0]), Lanes::Load(tri.v0[0] + i));
+		V sy = Lanes::Sub(Lanes::Set(ray.org[1]), Lanes::Load(tri.v0[1] + i));
+		V sz = Lanes::Sub(Lanes::Set(ray.org[2]), Lanes::Load(tri.v0[2] + i));
+		V beta = Lanes::Mul(Lanes::Add(Lanes::Add(Lanes::Mul(sx, px), Lanes::Mul(sy, py)), Lanes::Mul(sz, pz)), inv);
+		V qx = Lanes::Sub(Lanes::Mul(sy, e1z), Lanes::Mul(sz, e1y));
+		V qy = Lanes::Sub(Lanes::Mul(sz, e1x), Lanes::Mul(sx, e1z));
+		V qz = Lanes::Sub(Lanes::Mul(sx, e1y), Lanes::Mul(sy, e1x));
+		V gamma = Lanes::Mul(Lanes::Add(Lanes::Add(Lanes::Mul(dx, qx), Lanes::Mul(dy, qy)), Lanes::Mul(dz, qz)), inv);
+		V t = Lanes::Mul(Lanes::Add(Lanes::Add(Lanes::Mul(e2x, qx), Lanes::Mul(e2y, qy)), Lanes::Mul(e2z, qz)), inv);
+
+		V ok = Lanes::And(Lanes::Ge(Lanes::Abs(det), eps), Lanes::And(Lanes::Ge(beta, zero), Lanes::Le(beta, one)));
+		ok = Lanes::And(ok, Lanes::And(Lanes::Ge(gamma, zero), Lanes::Le(Lanes::Add(beta, gamma), one)));
+		ok = Lanes::And(ok, Lanes::And(Lanes::Ge(t, zero), Lanes::Ge(t, Lanes::Set(ray.tmin))));
+		ok = Lanes::And(ok, Lanes::Lt(t, Lanes::Set(ray.tmax)));
+		unsigned mask = Lanes::Mask(ok);
+		if (count - base < W)
+			mask &= (1u << (count - base)) - 1;
+		if (!mask)
+			continue;
+
+		alignas(32) float tv[W], bv[W], gv[W];
+		Lanes::Store(tv, t);
+		Lanes::Store(bv, beta);
+		Lanes::Store(gv, gamma);
+		while (mask)
+		{
+			int lane = LowestBit(mask);
+			mask &= mask - 1;
+			if (tv[lane] < ray.tmax)
+			{
+				ray.tmax = tv[lane];
+				hit.slot = i + lane;
+				hit.beta = bv[lane];
+				hit.gamma = gv[lane];
+				found = true;
+			}
+		}
+	}
+	return found;
+}
+
+// Entry and exit distances of the ray for the child boxes of a node. Near and far planes are picked
+// by the direction signs, so unused slots with inverted boxes miss
+template <typename Lanes>
+inline void ChildDistances(const WideNode<Lanes::W>& node, const WideRay& ray, const typename Lanes::V org[3], const typename Lanes::V inv[3],
+						   const bool negative[3], typename Lanes::V& tNear, typename Lanes::V& tFar)
+{
+	typedef typename Lanes::V V;
+	const V slack = Lanes::Set(1.0000004f);		// Same slack as AABB::Intersect
+	for (int j = 0; j < 3; j++)
+	{
+		V lo = Lanes::Load(negative[j]? node.bmax[j] : node.bmin[j]);
+		V hi = Lanes::Load(negative[j]? node.bmin[j] : node.bmax[j]);
+		tNear = Lanes::Max(Lanes::Mul(Lanes::Sub(lo, org[j]), inv[j]), tNear);
+		tFar = Lanes::Min(Lanes::Mul(Lanes::Mul(Lanes::Sub(hi, org[j]), inv[j]), slack), tFar);
+	}
+}
+
+// Quantized boxes are decoded straight into distances, origin + q * scale becomes q * a + b per axis
+template <typename Lanes>
+inline void ChildDistances(const QuantizedWideNode<Lanes::W>& node, const WideRay& ray, const typename Lanes::V org[3], const typename Lanes::V inv[3],
+						   const bool negative[3], typename Lanes::V& tNear, typename Lanes::V& tFar)
+{
+	typedef typename Lanes::V V;
+	const V slack = Lanes::Set(1.0000004f);
+	for (int j = 0; j < 3; j++)
+	{
+		V a = Lanes::Set(node.Scale(j) * ray.inv[j]);
+		V b = Lanes::Set((node.origin[j] - ray.org[j]) * ray.inv[j]);
+		V lo = Lanes::LoadBytes(negative[j]? node.qmax[j] : node.qmin[j]);
+		V hi = Lanes::LoadBytes(negative[j]? node.qmin[j] : node.qmax[j]);
+		tNear = Lanes::Max(Lanes::Add(Lanes::Mul(lo, a), b), tNear);
+		tFar = Lanes::Min(Lanes::Mul(Lanes::Add(Lanes::Mul(hi, a), b), slack), tFar);
+	}
+}
+
+template <typename Lanes, typename Node>
+bool Intersect(const Node* nodes, const TriangleView& tri, WideRay& ray, WideHit& hit)
+{
+	typedef typename Lanes::V V;
+	const int W = Lanes::W;
+	struct Entry
+	{
+		int node;
+		float t;
+	};
+	const int StackSize = 1024;
+	Entry stack[StackSize];
+
+	V org[3], inv[3];
+	bool negative[3];
+	for (int j = 0; j < 3; j++)
+	{
+		org[j] = Lanes::Set(ray.org[j]);
+		inv[j] = Lanes::Set(ray.inv[j]);
+		negative[j] = ray.inv[j] < 0;
+	}
+
+	bool found = false;
+	int sp = 0;
+	stack[sp++] = {0, 0.0f};
+	while (sp > 0)
+	{
+		Entry e = stack[--sp];
+		if (e.t > ray.tmax)
+			continue;
+		const Node& node = nodes[e.node];
+		V tNear = Lanes::Set(0.0f), tFar = Lanes::Set(ray.tmax);
+		ChildDistances<Lanes>(node, ray, org, inv, negative, tNear, tFar);
+		unsigned mask = Lanes::Mask(Lanes::Le(tNear, tFar));
+		if (!mask)
+			continue;
+
+		alignas(32) float near[W];
+		Lanes::Store(near, tNear);
+		Entry inner[W];
+		int nInner = 0;
+		while (mask)
+		{
+			int i = LowestBit(mask);
+			mask &= mask - 1;
+			if (node.Count(i) > 0)
+				found |= IntersectLeaf<Lanes>(tri, node.Child(i), node.Count(i), ray, hit);
+			else if (node.Child(i) >= 0)
+			{
+				// Keep the interior children sorted by decreasing distance, the nearest is pushed last
+				int k = nInner++;
+				for (; k > 0 && inner[k - 1].t < near[i]; k--)
+					inner[k] = inner[k - 1];
+				inner[k] = {node.Child(i), near[i]};
+			}
+		}
+		for (int k = 0; k < nInner; k++)
+			stack[sp++] = inner[k];
+	}
+	return found;
+}
+
+}
+
+#endif
@@ -13,26 +13,220 @@
 #include "render.hpp"
 
 #include <string>
+#include <omp.h>
 
 using namespace std;
 
+// Shoot the same random rays at a mesh under each acceleration structure and log the rays per second
+static void BenchmarkMesh(const char* filename)
+{
+	const int nRays = 1000000;
+	Lambert material(Vector3f(1, 1, 1));
+	const char* names[] = {" octree: ", " BVH: ", " wide BVH: ", " quantized BVH: "};
+	for (MeshAccel accel : {MeshAccel::OCTREE, MeshAccel::BVH, MeshAccel::WIDE_BVH, MeshAccel::QUANTIZED_BVH})
+	{
+		Mesh mesh(filename, &material, accel);
+		AABB box;
+		mesh.GetBounds(box);
+		Vector3f center(box.Center(0), box.Center(1), box.Center(2));
+		Vector3f size(box.max[0] - box.min[0], box.max[1] - box.min[1], box.max[2] - box.min[2]);
+
+		// Rays from a sphere around the mesh towards random points of its box
+		RandomGenerator rng(1);
+		std::vector<Ray> rays;
+		rays.reserve(nRays);
+		for (int i = 0; i < nRays; i++)
+		{
+			float phi = 2 * M_PI * rng.GetUniformReal();
+			float z = 2 * rng.GetUniformReal() - 1;
+			Vector3f origin = center + Vector3f(std::sqrt(1 - z * z) * std::cos(phi), std::sqrt(1 - z * z) * std::sin(phi), z) * size.length();
+			Vector3f target(box.min[0] + size[0] * rng.GetUniformReal(), box.min[1] + size[1] * rng.GetUniformReal(), box.min[2] + size[2] * rng.GetUniformReal());
+			rays.emplace_back(origin, (target - origin).normalized());
+		}
+
+		int hits = 0;
+		double distance = 0.0;
+		double start = omp_get_wtime();
+		#pragma omp parallel for schedule(dynamic, 1024) reduction(+: hits, distance)
+		for (int i = 0; i < nRays; i++)
+		{
+			Hit hit;
+			if (mesh.intersect(rays[i], hit, 1e-6))
+			{
+				hits++;
+				distance += hit.getT();
+			}
+		}
+		double time = omp_get_wtime() - start;
+		logging::INFO(std::string(filename) + names[accel] + std::to_string((long long)(nRays / time)) + " rays/s, "
+			+ std::to_string(hits) + " hits, mean distance " + std::to_string(hits? distance / hits : 0.0));
+	}
+}
+
+// Gather around random points of the unit cube surface with the full and the compact photon layout,
+// photons are spread over the same surface and every query finds about nGather of them
+static void BenchmarkPhotons(int nPhotons)
+{
+	const int nQueries = 200000, nGather = 100;
+	RandomGenerator rng(1);
+	auto SurfacePoint = [&]()
+	{
+		Vector3f p(rng.GetUniformReal(), rng.GetUniformReal(), rng.GetUniformReal());
+		int face = rng.GetUniformInt(0, 5);
+		p[face % 3] = face / 3;
+		return p;
+	};
+	std::vector<Photon> photons(nPhotons);
+	for (Photon& photon : photons)
+	{
+		photon.pos = SurfacePoint();
+		photon.dir = Vector3f(2 * rng.GetUniformReal() - 1, 2 * rng.GetUniformReal() - 1, 2 * rng.GetUniformReal() - 1).normalized();
+		photon.power = Vector3f(rng.GetUniformReal(), rng.GetUniformReal(), rng.GetUniformReal()) / nPhotons;
+	}
+	std::vector<Vector3f> targets(nQueries);
+	for (Vector3f& target : targets)
+		target = SurfacePoint();
+	float radius2 = nGather * 6.0f / (M_PI * nPhotons);
+
+	const char* names[] = {"kd-tree", "hash grid"};
+	for (MapType type : {MapType::KDTREE, MapType::HASHGRID})
+		for (bool compact : {false, true})
+		{
+			PhotonMap map(photons, type, compact);
+			map.Build(std::sqrt(radius2));
+			long long found = 0;
+			double power = 0.0;
+			double start = omp_get_wtime();
+			#pragma omp parallel for schedule(dynamic, 256) reduction(+: found, power)
+			for (int i = 0; i < nQueries; i++)
+				map.VisitNIR(targets[i], radius2, [&](const Photon& photon)
+				{
+					found++;
+					power += photon.power[0] + photon.power[1] + photon.power[2];
+				});
+			double time = omp_get_wtime() - start;
+			logging::INFO(std::string(names[type]) + (compact? " compact: " : " full: ") + std::to_string(map.GetPhotonBytes()) + " bytes per photon, "
+				+ std::to_string(map.GetSize() * map.GetPhotonBytes() / 1024 / 1024) + " MB, " + std::to_string((long long)(nQueries / time)) + " gathers/s, "
+				+ std::to_string((double)found / nQueries) + " photons per gather, power " + std::to_string(power));
+		}
+}
+
 int main(int argc, char *argv[])
 {
-	if (argc != 3)
+	const char* usage = "Usage: ./bin/PA1 <input scene file> <output bmp file> [--map kdtree|hashgrid] [--compact] [--batch] [--sppm] [--adaptive] [--wavefront] [--pipeline] [--snapshot-every <iterations>] [--snapshot-seconds <seconds>] [--frames <count> [--refit]] [--quantized-bvh] [--quantized-mesh]\n"
+						"       ./bin/PA1 --bench-mesh <obj file>...\n"
+						"       ./bin/PA1 --bench-photons <photon count>";
+	if (argc >= 2 && string(argv[1]) == "--bench-mesh")
+	{
+		for (int i = 2; i < argc; i++)
+			BenchmarkMesh(argv[i]);
+		return 0;
+	}
+	if (argc >= 3 && string(argv[1]) == "--bench-photons")
+	{
+		BenchmarkPhotons(atoi(argv[2]));
+		return 0;
+	}
+	if (argc < 3)
 	{
-		cout << "Usage: ./bin/PA1 <input scene file> <output bmp file>" << endl;
+		cout << usage << endl;
 		return 1;
 	}
 	string inputFile = argv[1];
 	string outputFile = argv[2] + std::string(".bmp"); // only bmp is allowed.
 
+	MapType mapType = MapType::KDTREE;
+	bool compact = false;
+	bool batch = false;
+	bool sppm = false;
+	bool adaptive = false;
+	bool wavefront = false;
+	bool pipeline = false;
+	int snapshotEvery = 1;
+	double snapshotSeconds = 0.0;
+	int frames = 0;
+	bool refit = false;
+	MeshAccel accel = MeshAccel::WIDE_BVH;
+	bool quantizeMeshes = false;
+	for (int i = 3; i < argc; i++)
+	{
+		string option = argv[i];
+		if (option == "--map" && i + 1 < argc)
+		{
+			string value = argv[++i];
+			if (value == "kdtree")
+				mapType = MapType::KDTREE;
+			else if (value == "hashgrid")
+				mapType = MapType::HASHGRID;
+			else
+			{
+				cout << usage << endl;
+				return 1;
+			}
+		}
+		else if (option == "--compact")
+			compact = true;
+		else if (option == "--batch")
+			batch = true;
+		else if (option == "--sppm")
+			sppm = true;
+		else if (option == "--adaptive")
+			adaptive = true;
+		else if (option == "--wavefront")
+			wavefront = true;
+		else if (option == "--pipeline")
+			pipeline = true;
+		else if (option == "--snapshot-every" && i + 1 < argc)
+			snapshotEvery = atoi(argv[++i]);
+		else if (option == "--snapshot-seconds" && i + 1 < argc)
+			snapshotSeconds = atof(argv[++i]);
+		else if (option == "--frames" && i + 1 < argc)
+			frames = atoi(argv[++i]);
+		else if (option == "--refit")
+			refit = true;
+		else if (option == "--quantized-bvh")
+			accel = MeshAccel::QUANTIZED_BVH;
+		else if (option == "--quantized-mesh")
+			quantizeMeshes = true;
+		else
+		{
+			cout << usage << endl;
+			return 1;
+		}
+	}
 	
-	SceneParser sceneParser(inputFile.c_str());
+	SceneParser sceneParser(inputFile.c_str(), accel, quantizeMeshes);
 	Camera *camera = sceneParser.getCamera();
-	Image image(camera->getWidth(), camera->getHeight());
-	PhotonMapping pm(400000, 400, 100, 16, 0.5, 0.75);
-	pm.Render(sceneParser, image);
+	// Frames of a sequence are posed in the loaded scene and written to <output>_<frame>.bmp
+	for (int frame = 0; frame < std::max(frames, 1); frame++)
+	{
+		double setup = 0.0;
+		if (frames > 0)
+		{
+			double start = omp_get_wtime();
+			sceneParser.SetFrame(frame, !refit);
+			setup = omp_get_wtime() - start;
+			char suffix[32];
+			snprintf(suffix, sizeof(suffix), "_%04d.bmp", frame);
+			outputFile = argv[2] + std::string(suffix);
+		}
 
-	image.SaveBMP(outputFile.c_str());
+		double start = omp_get_wtime();
+		Image image(camera->getWidth(), camera->getHeight());
+		PhotonMapping pm(400000, 400, 100, 16, 0.5, 0.75);
+		pm.SetMapType(mapType);
+		pm.SetCompactPhotons(compact);
+		pm.SetBatchGather(batch);
+		pm.SetSPPM(sppm);
+		pm.SetAdaptiveRadius(adaptive);
+		pm.SetWavefront(wavefront);
+		pm.SetPipeline(pipeline);
+		pm.SetSnapshot(snapshotEvery, snapshotSeconds);
+		pm.Render(sceneParser, image);
+
+		image.SaveBMP(outputFile.c_str());
+		if (frames > 0)
+			logging::INFO("Frame " + std::to_string(frame) + ": set up in " + std::to_string(setup * 1000) + " ms, rendered in " + std::to_string(omp_get_wtime() - start) + " s");
+	}
 	return 0;
 }
@@ -5,7 +5,10 @@
 #include <cstdlib>
 #include <utility>
 #include <sstream>
-#include <algorithm>
+#include <cstring>
+#include <cstdint>
+#include <unordered_map>
+#include <omp.h>
 
 #include "plane.hpp"
 
@@ -23,7 +26,54 @@ Material* GenerateMaterial(const Vector3f& Ka, const Vector3f& Kd, const Vector3
 		return hasTexture? new Generic(Ka, Kd, Ks, Ns, Ni, d, filename) : new Generic(Ka, Kd, Ks, Ns, Ni, d);
 }
 
-bool Octree::Traverse(Octree::OctNode* node, const Ray &r, Hit &h, float tmin) const
+namespace
+{
+
+// Position, normal and texture coordinate of a face corner, compared bit for bit. The OBJ position
+// and normal indices are -1 unless the mesh is deformable
+struct CornerKey
+{
+	float value[8];
+	int obj[2];
+	bool operator==(const CornerKey& other) const
+	{
+		return std::memcmp(this->value, other.value, sizeof(this->value)) == 0 && this->obj[0] == other.obj[0] && this->obj[1] == other.obj[1];
+	}
+};
+
+struct CornerHash
+{
+	size_t operator()(const CornerKey& key) const
+	{
+		size_t h = 0;
+		for (float x : key.value)
+		{
+			uint32_t bits;
+			std::memcpy(&bits, &x, sizeof(bits));
+			h = h * 1000003u ^ bits;
+		}
+		return h * 1000003u ^ (size_t)key.obj[0] * 31u ^ (size_t)key.obj[1];
+	}
+};
+
+// Octahedral encoding, two 16-bit coordinates of the normal projected onto |x| + |y| + |z| = 1
+unsigned EncodeOctahedral(const Vector3f& n)
+{
+	float l1 = std::abs(n[0]) + std::abs(n[1]) + std::abs(n[2]);
+	float x = (l1 > 0.0f)? n[0] / l1 : 0.0f, y = (l1 > 0.0f)? n[1] / l1 : 0.0f;
+	if (n[2] < 0.0f)
+	{
+		float fx = (1.0f - std::abs(y)) * (x < 0.0f? -1.0f : 1.0f), fy = (1.0f - std::abs(x)) * (y < 0.0f? -1.0f : 1.0f);
+		x = fx;
+		y = fy;
+	}
+	unsigned qx = std::lround((x + 1.0f) * 32767.5f), qy = std::lround((y + 1.0f) * 32767.5f);
+	return std::min(qx, 0xffffu) | (std::min(qy, 0xffffu) << 16);
+}
+
+}
+
+bool Octree::Traverse(Octree::OctNode* node, const Ray &r, float tmin, MeshData::MeshHit &hit) const
 {
 	if (node == nullptr)
 		return false;
@@ -32,14 +82,12 @@ bool Octree::Traverse(Octree::OctNode* node, const Ray &r, Hit &h, float tmin) c
 		bool result = false;
 		for (size_t idx : node->index)
 		{
-			Mesh* m = this->mesh;
-			Mesh::TriangleIndex triIdx = m->t[idx];
-			Triangle triangle(m->v[triIdx.vIdx[0]], m->v[triIdx.vIdx[1]], m->v[triIdx.vIdx[2]], triIdx.material);
-			if (triIdx.hasNormal)
-				triangle.SetNormal(m->n[triIdx.nIdx[0]], m->n[triIdx.nIdx[1]], m->n[triIdx.nIdx[2]]);
-			if (triIdx.hasTexture)
-				triangle.SetTexCoord(m->texcoord[triIdx.texIdx[0]], m->texcoord[triIdx.texIdx[1]], m->texcoord[triIdx.texIdx[2]]);
-			result |= triangle.intersect(r, h, tmin);
+			const MeshData::TriangleIndex& triIdx = this->mesh->t[idx];
+			if (Triangle::Intersect(this->mesh->GetPosition(triIdx.v[0]), this->mesh->GetPosition(triIdx.v[1]), this->mesh->GetPosition(triIdx.v[2]), r, tmin, hit.t, hit.beta, hit.gamma))
+			{
+				hit.idx = idx;
+				result = true;
+			}
 		}
 		return result;
 		/*
@@ -51,11 +99,11 @@ bool Octree::Traverse(Octree::OctNode* node, const Ray &r, Hit &h, float tmin) c
 	std::vector<std::pair<float, int>> tList;
 	for (int octant = 0; octant < 8; octant++)
 	{
-		Hit hit = h;
+		Hit box(hit.t);
 		if (node->ChildNode[octant] != nullptr)
 		{
-			if (node->ChildNode[octant]->BoundingBox->intersect(r, hit, tmin))
-				tList.push_back({hit.getT(), octant});
+			if (node->ChildNode[octant]->BoundingBox->intersect(r, box, tmin))
+				tList.push_back({box.getT(), octant});
 		}
 	}
 
@@ -63,45 +111,143 @@ bool Octree::Traverse(Octree::OctNode* node, const Ray &r, Hit &h, float tmin) c
 	bool result = false;
 	for (auto& p : tList)
 	{
-		result |= Traverse(node->ChildNode[p.second], r, h, tmin);
-		if (result && node->ChildNode[p.second]->BoundingBox->PointInBox(h.getSurface().position))
+		result |= Traverse(node->ChildNode[p.second], r, tmin, hit);
+		if (result && node->ChildNode[p.second]->BoundingBox->PointInBox(r.GetAt(hit.t)))
 			break;
 	}
 	return result;
 }
 
-bool Mesh::intersect(const Ray &r, Hit &h, float tmin) const
+Triangle MeshData::GetTriangle(size_t idx, Material *fallback) const
+{
+	const TriangleIndex& triIdx = this->t[idx];
+	Triangle triangle(this->GetPosition(triIdx.v[0]), this->GetPosition(triIdx.v[1]), this->GetPosition(triIdx.v[2]), this->GetMaterial(idx, fallback));
+	if (triIdx.hasNormal)
+		triangle.SetNormal(this->GetNormal(triIdx.v[0]), this->GetNormal(triIdx.v[1]), this->GetNormal(triIdx.v[2]));
+	if (triIdx.hasTexture)
+		triangle.SetTexCoord(this->texcoord[triIdx.v[0]], this->texcoord[triIdx.v[1]], this->texcoord[triIdx.v[2]]);
+	return triangle;
+}
+
+HitSurface MeshData::GetSurface(size_t idx, const Vector3f &position, float beta, float gamma, Material *material) const
+{
+	const TriangleIndex& triIdx = this->t[idx];
+	Vector3f a = this->GetPosition(triIdx.v[0]);
+	Vector3f geonormal = Vector3f::cross(this->GetPosition(triIdx.v[1]) - a, this->GetPosition(triIdx.v[2]) - a).normalized();
+	Vector3f norm = geonormal;
+	if (triIdx.hasNormal)
+		norm = (1 - beta - gamma) * this->GetNormal(triIdx.v[0]) + beta * this->GetNormal(triIdx.v[1]) + gamma * this->GetNormal(triIdx.v[2]);
+	bool HasTexture = triIdx.hasTexture && material->HasTexture();
+	Vector2f tex;
+	if (HasTexture)
+		tex = (1 - beta - gamma) * this->texcoord[triIdx.v[0]] + beta * this->texcoord[triIdx.v[1]] + gamma * this->texcoord[triIdx.v[2]];
+	return HitSurface(position, norm, geonormal, tex, HasTexture);
+}
+
+bool MeshData::intersect(const Ray &r, float tmin, MeshHit &hit) const
 {
+	if (this->accel == MeshAccel::OCTREE)
+		return this->tree->intersect(r, tmin, hit);
+
+	// Moller-Trumbore on the leaf records, only t and the barycentrics of the closest hit are kept
+	float org[3], dir[3];
+	for (int i = 0; i < 3; i++)
+	{
+		org[i] = r.getOrigin()[i];
+		dir[i] = r.getDirection()[i];
+	}
+	const TriangleRecords& rec = this->records;
+	int HitSlot = -1;
+	float HitT = hit.t, HitBeta = 0.0f, HitGamma = 0.0f;
+#ifdef WIDE_BVH_X86
+	if (this->accel == MeshAccel::WIDE_BVH || this->accel == MeshAccel::QUANTIZED_BVH)
+	{
+		if (this->Wide4.Empty() && this->Wide8.Empty())
+			return false;
+		WideRay ray;
+		for (int i = 0; i < 3; i++)
+		{
+			ray.org[i] = org[i];
+			ray.dir[i] = dir[i];
+			ray.inv[i] = r.getInvDirection()[i];
+		}
+		ray.tmin = tmin;
+		ray.tmax = hit.t;
+		WideHit whit;
+		bool found;
+		if (this->accel == MeshAccel::QUANTIZED_BVH)
+			found = this->Wide8.Empty()? IntersectWide4(this->Wide4.GetQuantizedNodes(), this->view, ray, whit) : IntersectWide8(this->Wide8.GetQuantizedNodes(), this->view, ray, whit);
+		else
+			found = this->Wide8.Empty()? IntersectWide4(this->Wide4.GetNodes(), this->view, ray, whit) : IntersectWide8(this->Wide8.GetNodes(), this->view, ray, whit);
+		if (!found)
+			return false;
+		HitSlot = whit.slot;
+		HitT = ray.tmax;
+		HitBeta = whit.beta;
+		HitGamma = whit.gamma;
+	}
+	else
+#endif
+	this->bvh.TraverseLeaves(r, HitT, [&](int begin, int end, float& tmax) {
+		bool result = false;
+		for (int i = begin; i < end; i++)
+		{
+			float e1x = rec.e1[0][i], e1y = rec.e1[1][i], e1z = rec.e1[2][i];
+			float e2x = rec.e2[0][i], e2y = rec.e2[1][i], e2z = rec.e2[2][i];
+			float px = dir[1] * e2z - dir[2] * e2y;
+			float py = dir[2] * e2x - dir[0] * e2z;
+			float pz = dir[0] * e2y - dir[1] * e2x;
+			float det = e1x * px + e1y * py + e1z * pz;
+			if (std::abs(det) < 1e-6f)
+				continue;
+			float inv = 1.0f / det;
+			float sx = org[0] - rec.v0[0][i], sy = org[1] - rec.v0[1][i], sz = org[2] - rec.v0[2][i];
+			float beta = (sx * px + sy * py + sz * pz) * inv;
+			if (beta < 0 || beta > 1)
+				continue;
+			float qx = sy * e1z - sz * e1y;
+			float qy = sz * e1x - sx * e1z;
+			float qz = sx * e1y - sy * e1x;
+			float gamma = (dir[0] * qx + dir[1] * qy + dir[2] * qz) * inv;
+			if (gamma < 0 || beta + gamma > 1)
+				continue;
+			float t = (e2x * qx + e2y * qy + e2z * qz) * inv;
+			if (t < 0 || t < tmin || t >= tmax)
+				continue;
+			tmax = HitT = t;
+			HitSlot = i;
+			HitBeta = beta;
+			HitGamma = gamma;
+			result = true;
+		}
+		return result;
+	});
+	if (HitSlot < 0)
+		return false;
 
-	// Optional: Change this brute force method into a faster one.
-	return this->tree->intersect(r, h, tmin);
+	hit = {HitT, this->bvh.GetPrimIdx()[HitSlot], HitBeta, HitGamma};
+	return true;
 }
 
 HitSurface Mesh::SamplePoint(double &pdf, RandomGenerator &rng) const
 {
-	int size = this->t.size();
+	int size = this->data->GetNumTriangles();
 	pdf = 1.0f / size;
 	int idx = rng.GetUniformInt(0, size - 1);
 	double objpdf;
-	TriangleIndex triIdx = this->t[idx];
-	Triangle triangle(this->v[triIdx.vIdx[0]], this->v[triIdx.vIdx[1]], this->v[triIdx.vIdx[2]], triIdx.material);
-	if (triIdx.hasNormal)
-		triangle.SetNormal(this->n[triIdx.nIdx[0]], this->n[triIdx.nIdx[1]], this->n[triIdx.nIdx[2]]);
-	if (triIdx.hasTexture)
-		triangle.SetTexCoord(this->texcoord[triIdx.texIdx[0]], this->texcoord[triIdx.texIdx[1]], this->texcoord[triIdx.texIdx[2]]);
-	HitSurface s = triangle.SamplePoint(objpdf, rng);
+	HitSurface s = this->data->GetTriangle(idx, this->material).SamplePoint(objpdf, rng);
 	pdf *= objpdf;
 	return s;
 }
 
-Mesh::~Mesh()
+MeshData::~MeshData()
 { 
 	delete this->tree; 
 	for (auto& p : this->MeshMaterial) 
 		delete p.second;
 }
 
-Mesh::Mesh(const char *filename, Material *material) : Object3D(material)
+MeshData::MeshData(const char *filename, MeshAccel accel, bool quantize, bool deformable) : quantize(quantize), accel(accel)
 {
 
 	// Optional: Use tiny obj loader to replace this simple one.
@@ -122,10 +268,23 @@ Mesh::Mesh(const char *filename, Material *material) : Object3D(material)
 	const std::string useTok("usemtl");
 	const char bslash = '/', space = ' ';
 	std::string tok;
-	Vector3f max(-INFINITY, -INFINITY, -INFINITY);
-	Vector3f min(INFINITY, INFINITY, INFINITY);
 
-	Material* curMaterial = this->material;
+	// Faces as written in the file, welded into vertices once everything is read
+	struct Face
+	{
+		int vIdx[3] = {};
+		int nIdx[3] = {};
+		int texIdx[3] = {};
+		bool hasNormal = false;
+		bool hasTexture = false;
+		unsigned short material = 0;
+	};
+	std::vector<Face> faces;
+	std::vector<Vector3f> ObjV, ObjN;
+	std::vector<Vector2f> ObjTex;
+	std::map<std::string, unsigned short> MaterialId;
+
+	unsigned short curMaterial = 0;
 	logging::INFO("Begin loading " + std::string(filename)); 
 	while (true)
 	{
@@ -154,39 +313,44 @@ Mesh::Mesh(const char *filename, Material *material) : Object3D(material)
 		{
 			std::string name;
 			ss >> name;
+			curMaterial = 0;
 			if (this->MeshMaterial.count(name))
-				curMaterial = this->MeshMaterial[name];
-			else
-				curMaterial = this->material;
+			{
+				auto id = MaterialId.find(name);
+				if (id != MaterialId.end())
+					curMaterial = id->second;
+				else if (this->materials.size() <= 0xffff)
+				{
+					curMaterial = MaterialId[name] = this->materials.size();
+					this->materials.push_back(this->MeshMaterial[name]);
+				}
+				else
+					logging::ERROR("Too many materials in " + std::string(filename) + ", " + name + " is ignored");
+			}
 		}
 		else if (tok == vTok)
 		{
 			Vector3f vec;
 			ss >> vec[0] >> vec[1] >> vec[2];
-			for (int i = 0; i < 3; i++)
-			{
-				max[i] = std::max(max[i], vec[i]);
-				min[i] = std::min(min[i], vec[i]);
-			}
-			this->v.push_back(vec);
+			ObjV.push_back(vec);
 		}
 		else if (tok == texTok)
 		{
 			Vector2f texcoord;
 			ss >> texcoord[0];
 			ss >> texcoord[1];
-			this->texcoord.push_back(texcoord);
+			ObjTex.push_back(texcoord);
 		}
 		else if (tok == nTok)
 		{
 			Vector3f norm;
 			ss >> norm[0] >> norm[1] >> norm[2];
-			this->n.push_back(norm);
+			ObjN.push_back(norm);
 		}
 		else if (tok == fTok)
 		{
 			std::string token[3];
-			TriangleIndex Idx;
+			Face Idx;
 			ss >> token[0] >> token[1] >> token[2];
 			for (int i = 0; i < 3; i++)
 			{
@@ -210,16 +374,89 @@ Mesh::Mesh(const char *filename, Material *material) : Object3D(material)
 
 			}
 			Idx.material = curMaterial;
-			this->t.push_back(Idx);
+			faces.push_back(Idx);
 		}
 	}
-	logging::INFO(std::string(filename) + " loading finished, " + std::to_string(this->v.size()) + " vertices "+ std::to_string(this->t.size()) + " triangles");
 	f.close();
 
-	BBox* BoundingBox = new BBox(max, min);
-	logging::INFO("Begin building octree");
-	this->tree = new Octree(this);
-	this->tree->Build(BoundingBox);
+	// Weld the corners, a face without normals or texture coordinates uses zero for them
+	bool AnyNormal = false, AnyTexture = false;
+	for (const Face& face : faces)
+	{
+		AnyNormal |= face.hasNormal;
+		AnyTexture |= face.hasTexture;
+	}
+	std::unordered_map<CornerKey, int, CornerHash> welded;
+	welded.reserve(ObjV.size());
+	std::vector<Vector3f> positions, normals;
+	this->t.resize(faces.size());
+	for (size_t i = 0; i < faces.size(); i++)
+	{
+		const Face& face = faces[i];
+		TriangleIndex& tri = this->t[i];
+		tri.material = face.material;
+		tri.hasNormal = face.hasNormal;
+		tri.hasTexture = face.hasTexture;
+		for (int k = 0; k < 3; k++)
+		{
+			const Vector3f& p = ObjV[face.vIdx[k]];
+			Vector3f norm = face.hasNormal? ObjN[face.nIdx[k]] : Vector3f::ZERO;
+			Vector2f tex = face.hasTexture? ObjTex[face.texIdx[k]] : Vector2f::ZERO;
+			int ObjNormal = face.hasNormal? face.nIdx[k] : -1;
+			CornerKey key{{p[0], p[1], p[2], norm[0], norm[1], norm[2], tex[0], tex[1]}, {-1, -1}};
+			if (deformable)
+			{
+				// Vertices touching in the first pose may move apart later
+				key.obj[0] = face.vIdx[k];
+				key.obj[1] = ObjNormal;
+			}
+			auto it = welded.emplace(key, (int)positions.size());
+			if (it.second)
+			{
+				positions.push_back(p);
+				if (AnyNormal)
+					normals.push_back(norm);
+				if (AnyTexture)
+					this->texcoord.push_back(tex);
+				if (deformable)
+					this->source.push_back({face.vIdx[k], ObjNormal});
+			}
+			tri.v[k] = it.first->second;
+		}
+	}
+	this->ObjPositions = ObjV.size();
+	this->ObjNormals = ObjN.size();
+	this->SetPositions(positions);
+	this->SetNormals(normals);
+	size_t memory = this->t.size() * sizeof(TriangleIndex) + this->v.size() * sizeof(Vector3f) + this->QuantizedV.size() * sizeof(unsigned short)
+		+ this->n.size() * sizeof(Vector3f) + this->QuantizedN.size() * sizeof(unsigned) + this->texcoord.size() * sizeof(Vector2f) + this->source.size() * sizeof(VertexSource);
+	logging::INFO(std::string(filename) + " loading finished, " + std::to_string(ObjV.size()) + " vertices welded into " + std::to_string(this->GetNumVertices()) + ", "
+		+ std::to_string(this->t.size()) + " triangles, " + std::to_string(memory / 1024) + " KB" + (this->quantize? " quantized" : ""));
+	double BuildStart = omp_get_wtime();
+	if (this->accel == MeshAccel::OCTREE)
+	{
+		logging::INFO("Begin building octree");
+		this->BuildOctree();
+		logging::INFO("Octree built in " + std::to_string((omp_get_wtime() - BuildStart) * 1000) + " ms");
+	}
+	else
+	{
+		logging::INFO("Begin building BVH");
+		this->bvh.Build(this->GetTriangleBounds());
+		this->UpdateRecords();
+		logging::INFO("BVH built in " + std::to_string((omp_get_wtime() - BuildStart) * 1000) + " ms with " + std::to_string(omp_get_max_threads()) + " threads, "
+			+ std::to_string(this->bvh.GetNumNodes()) + " nodes, " + std::to_string(this->bvh.GetNumNodes() * sizeof(BVHTree::Node) / 1024) + " KB");
+		this->BuildWide();
+#ifdef WIDE_BVH_X86
+		if (this->accel == MeshAccel::WIDE_BVH || this->accel == MeshAccel::QUANTIZED_BVH)
+		{
+			int width = this->Wide8.Empty()? 4 : 8;
+			size_t memory = (width == 8)? this->Wide8.GetMemory() : this->Wide4.GetMemory();
+			logging::INFO(std::string(this->accel == MeshAccel::QUANTIZED_BVH? "Quantized into " : "Collapsed into ") + std::to_string(width) + "-wide BVH, "
+				+ std::to_string(width == 8? this->Wide8.GetNumNodes() : this->Wide4.GetNumNodes()) + " nodes, " + std::to_string(memory / 1024) + " KB" + (width == 8? " (AVX2)" : " (SSE)"));
+		}
+#endif
+	}
 /*
 	for (auto& p : this->MeshMaterial)
 	{
@@ -228,7 +465,177 @@ Mesh::Mesh(const char *filename, Material *material) : Object3D(material)
 	}*/
 }
 
-void Mesh::parseMtl(const string& filename)
+void MeshData::BuildOctree()
+{
+	delete this->tree;
+	BBox* BoundingBox = new BBox(Vector3f(this->bounds.max[0], this->bounds.max[1], this->bounds.max[2]), Vector3f(this->bounds.min[0], this->bounds.min[1], this->bounds.min[2]));
+	this->tree = new Octree(this);
+	this->tree->Build(BoundingBox);
+}
+
+std::vector<AABB> MeshData::GetTriangleBounds() const
+{
+	std::vector<AABB> TriBounds(this->t.size());
+	#pragma omp parallel for
+	for (size_t i = 0; i < this->t.size(); i++)
+		for (int j = 0; j < 3; j++)
+			TriBounds[i].Expand(this->GetPosition(this->t[i].v[j]));
+	return TriBounds;
+}
+
+// Rewrite the intersection records in the leaf order of the BVH
+void MeshData::UpdateRecords()
+{
+	const std::vector<int>& order = this->bvh.GetPrimIdx();
+	for (int j = 0; j < 3; j++)
+	{
+		this->records.v0[j].resize(order.size() + MaxWideWidth);
+		this->records.e1[j].resize(order.size() + MaxWideWidth);
+		this->records.e2[j].resize(order.size() + MaxWideWidth);
+		this->view.v0[j] = this->records.v0[j].data();
+		this->view.e1[j] = this->records.e1[j].data();
+		this->view.e2[j] = this->records.e2[j].data();
+	}
+	#pragma omp parallel for
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		const TriangleIndex& triIdx = this->t[order[i]];
+		Vector3f a = this->GetPosition(triIdx.v[0]), b = this->GetPosition(triIdx.v[1]), c = this->GetPosition(triIdx.v[2]);
+		for (int j = 0; j < 3; j++)
+		{
+			this->records.v0[j][i] = a[j];
+			this->records.e1[j][i] = b[j] - a[j];
+			this->records.e2[j][i] = c[j] - a[j];
+		}
+	}
+}
+
+void MeshData::BuildWide()
+{
+#ifdef WIDE_BVH_X86
+	if (this->accel != MeshAccel::WIDE_BVH && this->accel != MeshAccel::QUANTIZED_BVH)
+		return;
+	if (CpuHasAVX2())
+		this->Wide8.Build(this->bvh);
+	else
+		this->Wide4.Build(this->bvh);
+	if (this->accel == MeshAccel::QUANTIZED_BVH)
+	{
+		this->Wide8.Quantize();
+		this->Wide4.Quantize();
+	}
+	// Only the wide nodes are traversed, a deformable mesh keeps the binary ones to refit them
+	if (this->source.empty())
+		this->bvh.ReleaseNodes();
+#endif
+}
+
+void MeshData::SetPositions(const std::vector<Vector3f> &positions)
+{
+	this->bounds = AABB();
+	for (const Vector3f& p : positions)
+		this->bounds.Expand(p);
+	if (!this->quantize)
+	{
+		this->v = positions;
+		return;
+	}
+	for (int j = 0; j < 3; j++)
+		this->step[j] = (this->bounds.max[j] - this->bounds.min[j]) / 65535.0f;
+	this->QuantizedV.resize(3 * positions.size());
+	for (size_t i = 0; i < positions.size(); i++)
+		for (int j = 0; j < 3; j++)
+		{
+			long q = (this->step[j] > 0.0f)? std::lround((positions[i][j] - this->bounds.min[j]) / this->step[j]) : 0;
+			this->QuantizedV[3 * i + j] = std::min(std::max(q, 0L), 65535L);
+		}
+	// The last step may round past the box
+	for (int j = 0; j < 3; j++)
+		this->bounds.max[j] = std::max(this->bounds.max[j], this->bounds.min[j] + 65535 * this->step[j]);
+}
+
+void MeshData::SetNormals(const std::vector<Vector3f> &normals)
+{
+	if (!this->quantize)
+	{
+		this->n = normals;
+		return;
+	}
+	this->QuantizedN.resize(normals.size());
+	for (size_t i = 0; i < normals.size(); i++)
+		this->QuantizedN[i] = EncodeOctahedral(normals[i]);
+}
+
+bool MeshData::Deform(const std::vector<Vector3f> &positions, const std::vector<Vector3f> &normals, bool rebuild)
+{
+	if (this->source.empty() && !this->t.empty())
+	{
+		logging::ERROR("Mesh was not loaded as deformable");
+		return false;
+	}
+	if ((int)positions.size() != this->ObjPositions)
+	{
+		logging::ERROR("Deformed mesh has " + std::to_string(positions.size()) + " vertices instead of " + std::to_string(this->ObjPositions));
+		return false;
+	}
+	std::vector<Vector3f> welded(this->source.size());
+	for (size_t i = 0; i < this->source.size(); i++)
+		welded[i] = positions[this->source[i].position];
+	this->SetPositions(welded);
+	if (!normals.empty() && (int)normals.size() == this->ObjNormals && (!this->n.empty() || !this->QuantizedN.empty()))
+	{
+		for (size_t i = 0; i < this->source.size(); i++)
+			welded[i] = (this->source[i].normal >= 0)? normals[this->source[i].normal] : Vector3f::ZERO;
+		this->SetNormals(welded);
+	}
+
+	if (this->accel == MeshAccel::OCTREE)
+	{
+		this->BuildOctree();
+		return true;
+	}
+	if (rebuild || this->bvh.GetNumNodes() == 0)
+		this->bvh.BuildLBVH(this->GetTriangleBounds());
+	else
+		this->bvh.Refit(this->GetTriangleBounds());
+	this->UpdateRecords();
+	this->BuildWide();
+	return true;
+}
+
+bool MeshData::ReadVertices(const char *filename, std::vector<Vector3f> &positions, std::vector<Vector3f> &normals)
+{
+	std::ifstream f(filename);
+	if (!f.is_open())
+	{
+		logging::ERROR("Cannot open " + std::string(filename));
+		return false;
+	}
+	positions.clear();
+	normals.clear();
+	std::string line, tok;
+	while (std::getline(f, line))
+	{
+		if (line.size() < 3 || line[0] != 'v')
+			continue;
+		std::stringstream ss(line);
+		ss >> tok;
+		Vector3f vec;
+		if (tok == "v")
+		{
+			ss >> vec[0] >> vec[1] >> vec[2];
+			positions.push_back(vec);
+		}
+		else if (tok == "vn")
+		{
+			ss >> vec[0] >> vec[1] >> vec[2];
+			normals.push_back(vec);
+		}
+	}
+	return true;
+}
+
+void MeshData::parseMtl(const string& filename)
 {
 	std::ifstream f;
 	f.open(filename);
@@ -5,51 +5,89 @@
 #include "utils.hpp"
 #include "camera.hpp"
 #include <omp.h>
+#include <atomic>
+#include <thread>
 
-void PhotonMapping::BuildPM(SceneParser& scene, std::vector<RandomGenerator>& rng_list)
+// Wavefront loop over queue.paths, one bounce per round: every ray is extended to its closest hit, the hits are sorted
+// by material and direction octant and shaded in that order, then the terminated paths are dropped.
+// miss(path) handles rays leaving the scene, shade(path, rng) returns false once the path terminates.
+// Paths still alive after Depth bounces are left in queue.paths
+template <typename Miss, typename Shade>
+void PhotonMapping::RunWavefront(PathQueue& queue, SceneParser& scene, std::vector<RandomGenerator>& rng_list, Miss&& miss, Shade&& shade)
 {
-	std::vector<Photon> Photons;
-	int nLights = scene.getNumLights();
-
-	#pragma omp parallel for schedule(dynamic, 100)
-	for (int PhotonIdx = 0; PhotonIdx < this->nPhoton; PhotonIdx++)
+	for (int depth = 0; depth < this->Depth && !queue.paths.empty(); depth++)
 	{
-		Vector3f power;
-		RandomGenerator& rng = rng_list[omp_get_thread_num()];
-
-		// Sample rar from light
-		int LightIdx = rng.GetUniformInt(0, nLights - 1);
-		Light* light = scene.getLight(LightIdx);
-		double pdf;
-		Ray ray = light->SampleRay(power, pdf, rng);
-		if (pdf < 0) 
-			continue;
-		power =  power / std::max(pdf, 1e-6) * nLights;
-
-		for (int DepthCount = 0; DepthCount < this->Depth; DepthCount++)
+		// Extend
+		size_t n = queue.paths.size();
+		queue.order.resize(n);
+		#pragma omp parallel for schedule(dynamic, 256)
+		for (size_t i = 0; i < n; i++)
 		{
-			if (!CheckValid(power)) 
-				break;
-			if (DepthCount > 0)
+			PathState& path = queue.paths[i];
+			path.hit = Hit();
+			if (!scene.intersect(Ray(path.origin, path.dir), path.hit, 1e-6, path.isLight, path.LightIdx))
 			{
-				// Use Russian Roulette
-				float prob = std::max(power[0], std::max(power[1], power[2]));
-				prob = (prob > 1.0f)? 1.0f : prob;
-				if (rng.GetUniformReal() >= prob)
-					break;
-				power = power / prob;
+				miss(path);
+				queue.order[i] = {UINT64_MAX, i};
+				continue;
 			}
+			// User space pointers stay far below 2^61, the low 3 bits hold the octant of the direction
+			uint64_t octant = (path.dir[0] < 0) | ((path.dir[1] < 0) << 1) | ((path.dir[2] < 0) << 2);
+			queue.order[i] = {((uint64_t)(uintptr_t)path.hit.getMaterial() << 3) | octant, i};
+		}
+
+		// Sort, missed rays go to the end
+		std::sort(queue.order.begin(), queue.order.end());
+		size_t nHit = std::lower_bound(queue.order.begin(), queue.order.end(), std::make_pair(UINT64_MAX, (size_t)0)) - queue.order.begin();
+
+		// Shade, the rays leaving a surface keep the sorted order for the next extend
+		queue.next.resize(nHit);
+		#pragma omp parallel for schedule(dynamic, 256)
+		for (size_t i = 0; i < nHit; i++)
+		{
+			PathState& path = queue.next[i];
+			path = queue.paths[queue.order[i].second];
+			path.active = shade(path, rng_list[omp_get_thread_num()]);
+		}
+
+		// Terminate
+		queue.next.erase(std::remove_if(queue.next.begin(), queue.next.end(), [](const PathState& path) { return !path.active; }), queue.next.end());
+		std::swap(queue.paths, queue.next);
+	}
+}
+
+// TracePhotons in wavefront mode, photons are emitted in batches of BatchSize paths
+template <typename Deposit>
+void PhotonMapping::TracePhotonsWavefront(SceneParser& scene, std::vector<RandomGenerator>& rng_list, Deposit&& deposit)
+{
+	int nLights = scene.getNumLights();
+	std::vector<PathState>& paths = this->PhotonQueue.paths;
+	for (int begin = 0; begin < this->nPhoton; begin += this->BatchSize)
+	{
+		int end = std::min(this->nPhoton, begin + this->BatchSize);
+		paths.resize(end - begin);
+		#pragma omp parallel for schedule(dynamic, 256)
+		for (int i = begin; i < end; i++)
+		{
+			RandomGenerator& rng = rng_list[omp_get_thread_num()];
+			PathState& path = paths[i - begin];
+			int LightIdx = rng.GetUniformInt(0, nLights - 1);
+			double pdf;
+			Ray ray = scene.getLight(LightIdx)->SampleRay(path.power, pdf, rng);
+			path.origin = ray.getOrigin();
+			path.dir = ray.getDirection();
+			path.power = path.power / std::max(pdf, 1e-6) * nLights;
+			path.active = pdf >= 0 && CheckValid(path.power);
+		}
+		paths.erase(std::remove_if(paths.begin(), paths.end(), [](const PathState& path) { return !path.active; }), paths.end());
 
-			Hit hit;
-			bool isLight;
-			int LightIdx;
-			if (!scene.intersect(ray, hit, 1e-6, isLight, LightIdx)) 
-				break;
-			Material* material = hit.getMaterial();
-			const HitSurface& surface = hit.getSurface();
-			Vector3f in = -ray.getDirection().normalized();
+		this->RunWavefront(this->PhotonQueue, scene, rng_list, [](PathState& path) {}, [&](PathState& path, RandomGenerator& rng) {
+			// The same ray as in the extend step, its unit direction is cached
+			Ray ray(path.origin, path.dir);
+			Material* material = path.hit.getMaterial();
+			HitSurface surface = path.hit.finalize(ray);
+			Vector3f in = -ray.getUnitDirection();
 
-			// Sample new out direction
 			double pdf;
 			RefType type;
 			Vector3f out;
@@ -57,54 +95,158 @@ void PhotonMapping::BuildPM(SceneParser& scene, std::vector<RandomGenerator>& rn
 			Vector3f binormal = Vector3f::cross(surface.normal, tangent).normalized();
 			Vector3f co = material->SampleOutDir(AbsToRel(tangent, binormal, surface.normal, in), out, TransportMode::LIGHT, pdf, type, rng);
 			if (type == RefType::DIFFUSE)
-			{
-				#pragma omp critical
-				{
-					Photons.push_back(Photon{surface.position, in, power});
-				}
-			}
+				deposit(Photon{surface.position, in, path.power});
 			if (surface.HasTexture && material->HasTexture())
-			{
 				co = co * material->GetTexture(surface.texcoord);
-			}
 			out = RelToAbs(tangent, binormal, surface.normal, out);
-			ray = Ray(surface.position, out);
-			power = power * co / std::max(pdf, 1e-6)  
+			path.origin = surface.position;
+			path.dir = out;
+			path.power = path.power * co / std::max(pdf, 1e-6) 
 				* std::abs(Vector3f::dot(out, surface.geonormal)) * std::abs(Vector3f::dot(in, surface.normal)) / std::abs(Vector3f::dot(in, surface.geonormal));
+
+			// Russian Roulette for the next bounce
+			if (!CheckValid(path.power))
+				return false;
+			float prob = std::max(path.power[0], std::max(path.power[1], path.power[2]));
+			prob = (prob > 1.0f)? 1.0f : prob;
+			if (rng.GetUniformReal() >= prob)
+				return false;
+			path.power = path.power / prob;
+			return true;
+		});
+	}
+}
+
+// Trace nPhoton photon paths, deposit(photon) is called on the tracing thread at every diffuse hit
+template <typename Deposit>
+void PhotonMapping::TracePhotons(SceneParser& scene, std::vector<RandomGenerator>& rng_list, Deposit&& deposit)
+{
+	if (this->Wavefront)
+	{
+		this->TracePhotonsWavefront(scene, rng_list, deposit);
+		return;
+	}
+	int nLights = scene.getNumLights();
+	#pragma omp parallel
+	{
+		RandomGenerator& rng = rng_list[omp_get_thread_num()];
+		#pragma omp for schedule(dynamic, 100)
+		for (int PhotonIdx = 0; PhotonIdx < this->nPhoton; PhotonIdx++)
+		{
+			Vector3f power;
+
+			// Sample rar from light
+			int LightIdx = rng.GetUniformInt(0, nLights - 1);
+			Light* light = scene.getLight(LightIdx);
+			double pdf;
+			Ray ray = light->SampleRay(power, pdf, rng);
+			if (pdf < 0) 
+				continue;
+			power =  power / std::max(pdf, 1e-6) * nLights;
+
+			for (int DepthCount = 0; DepthCount < this->Depth; DepthCount++)
+			{
+				if (!CheckValid(power)) 
+					break;
+				if (DepthCount > 0)
+				{
+					// Use Russian Roulette
+					float prob = std::max(power[0], std::max(power[1], power[2]));
+					prob = (prob > 1.0f)? 1.0f : prob;
+					if (rng.GetUniformReal() >= prob)
+						break;
+					power = power / prob;
+				}
+
+				Hit hit;
+				bool isLight;
+				int LightIdx;
+				if (!scene.intersect(ray, hit, 1e-6, isLight, LightIdx)) 
+					break;
+				Material* material = hit.getMaterial();
+				HitSurface surface = hit.finalize(ray);
+				Vector3f in = -ray.getUnitDirection();
+
+				// Sample new out direction
+				double pdf;
+				RefType type;
+				Vector3f out;
+				Vector3f tangent = GetPerpendicular(surface.normal);
+				Vector3f binormal = Vector3f::cross(surface.normal, tangent).normalized();
+				Vector3f co = material->SampleOutDir(AbsToRel(tangent, binormal, surface.normal, in), out, TransportMode::LIGHT, pdf, type, rng);
+				if (type == RefType::DIFFUSE)
+				{
+					deposit(Photon{surface.position, in, power});
+				}
+				if (surface.HasTexture && material->HasTexture())
+				{
+					co = co * material->GetTexture(surface.texcoord);
+				}
+				out = RelToAbs(tangent, binormal, surface.normal, out);
+				ray = Ray(surface.position, out);
+				power = power * co / std::max(pdf, 1e-6)  
+					* std::abs(Vector3f::dot(out, surface.geonormal)) * std::abs(Vector3f::dot(in, surface.normal)) / std::abs(Vector3f::dot(in, surface.geonormal));
+			}
 		}
 	}
+}
+
+// Trace a photon pass into pm and build its search structure for gathers of the given radius
+void PhotonMapping::BuildPM(SceneParser& scene, std::vector<RandomGenerator>& rng_list, PhotonMap& pm, float radius)
+{
+	std::vector<Photon> Photons = pm.Release();	// Reuse the storage of the last pass
+	std::vector<size_t> Offset;
+
+	// Each thread records into its own buffer, the buffers are then copied side by side into Photons
+	this->PhotonBuffers.resize(omp_get_max_threads());
+	for (auto& buffer : this->PhotonBuffers)
+		buffer.photons.clear();
+	double TraceStart = omp_get_wtime();
+	this->TracePhotons(scene, rng_list, [&](const Photon& photon) {
+		this->PhotonBuffers[omp_get_thread_num()].photons.push_back(photon);
+	});
+	Offset.assign(this->PhotonBuffers.size() + 1, 0);
+	for (size_t i = 0; i < this->PhotonBuffers.size(); i++)
+		Offset[i + 1] = Offset[i] + this->PhotonBuffers[i].photons.size();
+	Photons.resize(Offset.back());
+	#pragma omp parallel for
+	for (size_t i = 0; i < this->PhotonBuffers.size(); i++)
+		std::copy(this->PhotonBuffers[i].photons.begin(), this->PhotonBuffers[i].photons.end(), Photons.begin() + Offset[i]);
+	double TraceTime = omp_get_wtime() - TraceStart;
 	logging::INFO("Number of Photons recorded: " + std::to_string(Photons.size()));
-	this->GlobalPM.Clear();
-	this->GlobalPM.Set(Photons);
-	logging::INFO("Building kdtree");
-	this->GlobalPM.Build();
+	logging::INFO("Photon tracing finished in " + std::to_string(TraceTime * 1000) + " ms, " 
+		+ std::to_string((long long)(this->nPhoton / TraceTime)) + " photons/s emitted, " 
+		+ std::to_string((long long)(Photons.size() / TraceTime)) + " photons/s recorded");
+	pm.Set(std::move(Photons));
+	logging::INFO(std::string("Building ") + ((pm.GetType() == MapType::HASHGRID)? "hash grid" : "kdtree"));
+	double BuildStart = omp_get_wtime();
+	pm.Build(radius);
+	logging::INFO("Photon map built in " + std::to_string((omp_get_wtime() - BuildStart) * 1000) + " ms with " + std::to_string(omp_get_max_threads()) + " threads");
+	logging::INFO("Photon map memory: " + std::to_string(pm.GetPhotonBytes()) + " bytes per photon, " 
+		+ std::to_string(pm.GetPhotonBytes() * pm.GetSize() / (1024.0 * 1024.0)) + " MB");
 }
 
-Vector3f PhotonMapping::GetPhotonRadiance(const Vector3f& v, const Hit& hit, SceneParser& scene, RandomGenerator& rng)
+Vector3f PhotonMapping::GetPhotonRadiance(const Vector3f& v, Material* material, const HitSurface& surface, float radius, int& found, SceneParser& scene, RandomGenerator& rng)
 {
-	std::vector<int> result;
-	const HitSurface& surface = hit.getSurface();
-	Material* material = hit.getMaterial();
-	int num = this->GlobalPM.QueryNIR(surface.position, this->SearchRadius * this->SearchRadius, result);
 	Vector3f tangent = GetPerpendicular(surface.normal);
 	Vector3f binormal = Vector3f::cross(surface.normal, tangent).normalized();
 	Vector3f in = AbsToRel(tangent, binormal, surface.normal, -v);
 
+	// Accumulate inside the traversal, no index list is built
 	Vector3f color = Vector3f::ZERO;
-	for (auto& idx : result)
-	{
-		Photon ph = this->GlobalPM[idx];
+	this->GlobalPM.VisitNIR(surface.position, radius * radius, [&](const Photon& ph) {
+		found++;
 		color += ph.power * material->Shade(in,
 							AbsToRel(tangent, binormal, surface.normal, ph.dir),
 							TransportMode::CAMERA);
-	};
-	if (surface.HasTexture && hit.getMaterial()->HasTexture())
-		color = color * hit.getMaterial()->GetTexture(surface.texcoord);
-	return color / (M_PI * this->SearchRadius * this->SearchRadius * this->nPhoton) 
+	});
+	if (surface.HasTexture && material->HasTexture())
+		color = color * material->GetTexture(surface.texcoord);
+	return color / (M_PI * radius * radius * this->nPhoton) 
 		+ scene.getAmbient() * material->Shade(in, Vector3f(0, 0, 1), TransportMode::CAMERA);
 }
 
-Vector3f PhotonMapping:: GetRadiance(const Ray& r, SceneParser& scene, RandomGenerator& rng)
+bool PhotonMapping::TraceCameraPath(const Ray& r, SceneParser& scene, RandomGenerator& rng, HitPoint& hp)
 {
 	Ray ray = r;
 	Vector3f power(1, 1, 1);
@@ -114,11 +256,14 @@ Vector3f PhotonMapping:: GetRadiance(const Ray& r, SceneParser& scene, RandomGen
 		bool isLight;
 		int LightIdx = 0;
 		if (!scene.intersect(ray, hit, 1e-6, isLight, LightIdx))
-			return scene.getBackgroundColor();
-		Vector3f dir = ray.getDirection().normalized();
+		{
+			hp.color = scene.getBackgroundColor();
+			return false;
+		}
+		Vector3f dir = ray.getUnitDirection();
 
 		Material* material = hit.getMaterial();
-		HitSurface surface = hit.getSurface();
+		HitSurface surface = hit.finalize(ray);
 
 		double pdf;
 		RefType type;
@@ -128,10 +273,12 @@ Vector3f PhotonMapping:: GetRadiance(const Ray& r, SceneParser& scene, RandomGen
 		Vector3f co = material->SampleOutDir(AbsToRel(tangent, binormal, surface.normal, -dir), out, TransportMode::CAMERA, pdf, type, rng);
 		if (type == RefType::DIFFUSE)
 		{
-			if (isLight)
-				return power * (this->GetPhotonRadiance(dir, hit, scene, rng) 
-					+ scene.getLight(LightIdx)->GetIllumin(dir) * std::abs(Vector3f::dot(dir, surface.normal)));
-			return power * this->GetPhotonRadiance(dir, hit, scene, rng);
+			hp.material = material;
+			hp.surface = surface;
+			hp.dir = dir;
+			hp.weight = power;
+			hp.color = isLight? scene.getLight(LightIdx)->GetIllumin(dir) * std::abs(Vector3f::dot(dir, surface.normal)) : Vector3f::ZERO;
+			return true;
 		}
 		if (surface.HasTexture && material->HasTexture())
 			power = power * material->GetTexture(surface.texcoord);
@@ -141,7 +288,343 @@ Vector3f PhotonMapping:: GetRadiance(const Ray& r, SceneParser& scene, RandomGen
 		if (power.length() < 1e-5)
 			break;
 	}
-	return power;
+	hp.color = power;
+	return false;
+}
+
+// Trace camera paths [0, count) up to their first diffuse hit into HitPoints, sample(i, rng) gives the camera ray of path i
+template <typename Sampler>
+void PhotonMapping::TraceCameraPaths(SceneParser& scene, std::vector<RandomGenerator>& rng_list, size_t count, Sampler&& sample)
+{
+	if (!this->Wavefront)
+	{
+		#pragma omp parallel for schedule(dynamic, 64)
+		for (size_t i = 0; i < count; i++)
+		{
+			RandomGenerator& rng = rng_list[omp_get_thread_num()];
+			HitPoint& hp = this->HitPoints[i];
+			hp.gather = this->TraceCameraPath(sample(i, rng), scene, rng, hp);
+			hp.found = 0;
+		}
+		return;
+	}
+
+	std::vector<PathState>& paths = this->CameraQueue.paths;
+	paths.resize(count);
+	#pragma omp parallel for schedule(dynamic, 256)
+	for (size_t i = 0; i < count; i++)
+	{
+		Ray ray = sample(i, rng_list[omp_get_thread_num()]);
+		PathState& path = paths[i];
+		path.origin = ray.getOrigin();
+		path.dir = ray.getDirection();
+		path.power = Vector3f(1, 1, 1);
+		path.slot = i;
+		this->HitPoints[i].gather = false;
+		this->HitPoints[i].found = 0;
+	}
+	this->RunWavefront(this->CameraQueue, scene, rng_list, [&](PathState& path) {
+		this->HitPoints[path.slot].color = scene.getBackgroundColor();
+	}, [&](PathState& path, RandomGenerator& rng) {
+		HitPoint& hp = this->HitPoints[path.slot];
+		Ray ray(path.origin, path.dir);
+		Vector3f dir = ray.getUnitDirection();
+		Material* material = path.hit.getMaterial();
+		HitSurface surface = path.hit.finalize(ray);
+
+		double pdf;
+		RefType type;
+		Vector3f out;
+		Vector3f tangent = GetPerpendicular(surface.normal);
+		Vector3f binormal = Vector3f::cross(surface.normal, tangent).normalized();
+		Vector3f co = material->SampleOutDir(AbsToRel(tangent, binormal, surface.normal, -dir), out, TransportMode::CAMERA, pdf, type, rng);
+		if (type == RefType::DIFFUSE)
+		{
+			hp.material = material;
+			hp.surface = surface;
+			hp.dir = dir;
+			hp.weight = path.power;
+			hp.color = path.isLight? scene.getLight(path.LightIdx)->GetIllumin(dir) * std::abs(Vector3f::dot(dir, surface.normal)) : Vector3f::ZERO;
+			hp.gather = true;
+			return false;
+		}
+		if (surface.HasTexture && material->HasTexture())
+			path.power = path.power * material->GetTexture(surface.texcoord);
+		out = RelToAbs(tangent, binormal, surface.normal, out);
+		path.origin = surface.position;
+		path.dir = out;
+		path.power = path.power * co * std::abs(Vector3f::dot(out, surface.normal)) / std::max(pdf, 1e-6);
+		if (path.power.length() < 1e-5)
+		{
+			hp.color = path.power;
+			return false;
+		}
+		return true;
+	});
+
+	// Paths that ran out of bounces
+	#pragma omp parallel for
+	for (size_t i = 0; i < paths.size(); i++)
+		this->HitPoints[paths[i].slot].color = paths[i].power;
+}
+
+Vector3f PhotonMapping:: GetRadiance(const Ray& r, float radius, int& found, SceneParser& scene, RandomGenerator& rng)
+{
+	HitPoint hp;
+	if (!this->TraceCameraPath(r, scene, rng, hp))
+		return hp.color;
+	return hp.weight * (this->GetPhotonRadiance(hp.dir, hp.material, hp.surface, radius, found, scene, rng) + hp.color);
+}
+
+// Progressive photon mapping update with the M photons found per gather, N' = N + alpha * M, R'^2 = R^2 * N' / (N + M)
+void PhotonMapping::UpdateRadius(int pixel, float M)
+{
+	if (!this->AdaptiveRadius || M <= 0)
+		return;
+	PixelRadius& px = this->Radii[pixel];
+	float N = px.N + this->alpha * M;
+	px.radius *= std::sqrt(N / (px.N + M));
+	px.N = N;
+}
+
+void PhotonMapping::GatherPixels(SceneParser& scene, std::vector<RandomGenerator>& rng_list, std::vector<Vector3f>& img, int Width, int Height)
+{
+	TileScheduler scheduler(Width, Height, this->TileSize, omp_get_max_threads());
+	int nTiles = scheduler.GetNumTiles();
+	std::atomic<int> count(0);
+	#pragma omp parallel
+	{
+		int tid = omp_get_thread_num();
+		RandomGenerator& rng = rng_list[tid];
+		std::vector<Vector3f> TileImg(this->TileSize * this->TileSize);
+		Tile tile;
+		while (scheduler.Next(tid, tile))
+		{
+			int TileHeight = tile.y1 - tile.y0;
+			for (int i = tile.x0; i < tile.x1; i++)
+			{
+				for (int j = tile.y0; j < tile.y1; j++)
+				{
+					Vector3f col = Vector3f::ZERO;
+					float radius = this->GetGatherRadius(j + i * Height);
+					int found = 0;
+					for (int k = 0; k < this->nRays; k++)
+					{
+						Ray camRay = scene.getCamera()->SampleRay(i, j, rng);
+						Vector3f co = GetRadiance(camRay, radius, found, scene, rng);
+						if (!CheckValid(co))
+							continue;
+						col += co;
+					}
+					TileImg[(j - tile.y0) + (i - tile.x0) * TileHeight] = col / this->nRays;
+					this->UpdateRadius(j + i * Height, (float)found / this->nRays);
+				}
+			}
+
+			// Write the finished tile back column by column
+			for (int i = tile.x0; i < tile.x1; i++)
+				for (int j = tile.y0; j < tile.y1; j++)
+					img[j + i * Height] += TileImg[(j - tile.y0) + (i - tile.x0) * TileHeight];
+
+			int finished = count.fetch_add(1, std::memory_order_relaxed) + 1;
+			if (!(finished % 64))
+				logging::INFO(std::to_string(finished) + "/" + std::to_string(nTiles) + " tiles finished\033[F");
+		}
+	}
+}
+
+void PhotonMapping::GatherBatched(SceneParser& scene, std::vector<RandomGenerator>& rng_list, std::vector<Vector3f>& img, int Width, int Height)
+{
+	int nPixels = Width * Height;
+	int BatchPixels = std::max(1, this->BatchSize / this->nRays);
+	this->HitPoints.resize((size_t)BatchPixels * this->nRays);
+	for (int begin = 0; begin < nPixels; begin += BatchPixels)
+	{
+		int end = std::min(nPixels, begin + BatchPixels);
+
+		// Trace every camera path of the batch up to its first diffuse hit, pixel p owns nRays slots
+		this->TraceCameraPaths(scene, rng_list, (size_t)(end - begin) * this->nRays, [&](size_t i, RandomGenerator& rng) {
+			int p = begin + (int)(i / this->nRays);
+			return scene.getCamera()->SampleRay(p / Height, p % Height, rng);
+		});
+
+		// Sort the hit points needing a gather by the Morton code of their position
+		size_t nHitPoints = (size_t)(end - begin) * this->nRays;
+		Vector3f max(-INFINITY, -INFINITY, -INFINITY);
+		Vector3f min(INFINITY, INFINITY, INFINITY);
+		for (size_t i = 0; i < nHitPoints; i++)
+		{
+			if (!this->HitPoints[i].gather)
+				continue;
+			const Vector3f& pos = this->HitPoints[i].surface.position;
+			for (int j = 0; j < 3; j++)
+			{
+				max[j] = std::max(max[j], pos[j]);
+				min[j] = std::min(min[j], pos[j]);
+			}
+		}
+		Vector3f scale;
+		for (int j = 0; j < 3; j++)
+			scale[j] = (max[j] > min[j])? ((1 << 21) - 1) / (max[j] - min[j]) : 0.0f;
+		this->GatherOrder.clear();
+		for (size_t i = 0; i < nHitPoints; i++)
+		{
+			if (!this->HitPoints[i].gather)
+				continue;
+			Vector3f pos = (this->HitPoints[i].surface.position - min) * scale;
+			this->GatherOrder.emplace_back(MortonCode((unsigned)pos[0], (unsigned)pos[1], (unsigned)pos[2]), i);
+		}
+		std::sort(this->GatherOrder.begin(), this->GatherOrder.end());
+
+		// Neighbouring queries now touch neighbouring parts of the photon map
+		#pragma omp parallel for schedule(dynamic, 64)
+		for (size_t i = 0; i < this->GatherOrder.size(); i++)
+		{
+			size_t idx = this->GatherOrder[i].second;
+			HitPoint& hp = this->HitPoints[idx];
+			float radius = this->GetGatherRadius(begin + idx / this->nRays);
+			hp.color = hp.weight * (this->GetPhotonRadiance(hp.dir, hp.material, hp.surface, radius, hp.found, scene, rng_list[omp_get_thread_num()]) + hp.color);
+		}
+
+		#pragma omp parallel for
+		for (int p = begin; p < end; p++)
+		{
+			Vector3f col = Vector3f::ZERO;
+			int found = 0;
+			for (int k = 0; k < this->nRays; k++)
+			{
+				const HitPoint& hp = this->HitPoints[(size_t)(p - begin) * this->nRays + k];
+				found += hp.found;
+				if (!CheckValid(hp.color))
+					continue;
+				col += hp.color;
+			}
+			img[p] += col / this->nRays;
+			this->UpdateRadius(p, (float)found / this->nRays);
+		}
+		logging::INFO(std::to_string(end) + "/" + std::to_string(nPixels) + " pixels finished\033[F");
+	}
+}
+
+void PhotonMapping::IterateSPPM(SceneParser& scene, std::vector<RandomGenerator>& rng_list, std::vector<Vector3f>& img, int Width, int Height)
+{
+	int nPixels = Width * Height;
+
+	// Camera pass, one path per pixel and iteration, antialiasing comes from the iterations
+	double CameraStart = omp_get_wtime();
+	this->VisiblePoints.resize(nPixels);
+	this->HitPoints.resize(nPixels);
+	this->TraceCameraPaths(scene, rng_list, nPixels, [&](size_t p, RandomGenerator& rng) {
+		return scene.getCamera()->SampleRay((int)p / Height, (int)p % Height, rng);
+	});
+	#pragma omp parallel for schedule(dynamic, 64)
+	for (int p = 0; p < nPixels; p++)
+	{
+		VisiblePoint& vp = this->VisiblePoints[p];
+		vp.pixel = -1;
+		const HitPoint& hp = this->HitPoints[p];
+		if (!hp.gather)
+		{
+			if (CheckValid(hp.color))
+				this->Pixels[p].direct += hp.color;
+			continue;
+		}
+		const HitSurface& surface = hp.surface;
+		vp.material = hp.material;
+		vp.pos = surface.position;
+		vp.normal = surface.normal;
+		vp.tangent = GetPerpendicular(surface.normal);
+		vp.binormal = Vector3f::cross(surface.normal, vp.tangent).normalized();
+		vp.in = AbsToRel(vp.tangent, vp.binormal, vp.normal, -hp.dir);
+		vp.weight = hp.weight;
+		if (surface.HasTexture && vp.material->HasTexture())
+			vp.weight = vp.weight * vp.material->GetTexture(surface.texcoord);
+		Vector3f direct = hp.weight * (hp.color + scene.getAmbient() * vp.material->Shade(vp.in, Vector3f(0, 0, 1), TransportMode::CAMERA));
+		if (CheckValid(direct))
+			this->Pixels[p].direct += direct;
+		vp.pixel = p;
+	}
+	int nVisible = 0;
+	for (int p = 0; p < nPixels; p++)
+	{
+		if (this->VisiblePoints[p].pixel >= 0)
+			this->VisiblePoints[nVisible++] = this->VisiblePoints[p];
+	}
+	float MaxRadius = 0.0f;
+	for (const SPPMPixel& px : this->Pixels)
+		MaxRadius = std::max(MaxRadius, px.radius);
+	this->VisibleGrid.Set(this->VisiblePoints.data(), nVisible);
+	this->VisibleGrid.Build(2 * MaxRadius);
+	logging::INFO(std::to_string(nVisible) + " visible points collected in " + std::to_string((omp_get_wtime() - CameraStart) * 1000) + " ms");
+
+	// Photon pass, photons are splatted into the visible points instead of being stored
+	double TraceStart = omp_get_wtime();
+	this->TracePhotons(scene, rng_list, [&](const Photon& photon) {
+		this->VisibleGrid.SearchNIR(photon.pos, MaxRadius * MaxRadius, [&](const VisiblePoint& vp, int idx) {
+			SPPMPixel& px = this->Pixels[vp.pixel];
+			if ((vp.pos - photon.pos).squaredLength() >= px.radius * px.radius)
+				return;
+			Vector3f flux = vp.weight * photon.power * vp.material->Shade(vp.in, 
+										AbsToRel(vp.tangent, vp.binormal, vp.normal, photon.dir), 
+										TransportMode::CAMERA);
+			for (int i = 0; i < 3; i++)
+			{
+				#pragma omp atomic
+				px.phi[i] += flux[i];
+			}
+			#pragma omp atomic
+			px.M++;
+		});
+	});
+	double TraceTime = omp_get_wtime() - TraceStart;
+	logging::INFO("Photon pass finished in " + std::to_string(TraceTime * 1000) + " ms, " 
+		+ std::to_string((long long)(this->nPhoton / TraceTime)) + " photons/s emitted");
+
+	// Progressive radiance estimate update, N' = N + alpha * M, R'^2 = R^2 * N' / (N + M)
+	#pragma omp parallel for
+	for (int p = 0; p < nPixels; p++)
+	{
+		SPPMPixel& px = this->Pixels[p];
+		if (px.M > 0)
+		{
+			float N = px.N + this->alpha * px.M;
+			float radius = px.radius * std::sqrt(N / (px.N + px.M));
+			px.tau = (px.tau + Vector3f(px.phi[0], px.phi[1], px.phi[2])) * (radius * radius) / (px.radius * px.radius);
+			px.N = N;
+			px.radius = radius;
+			px.M = 0;
+			px.phi[0] = px.phi[1] = px.phi[2] = 0.0f;
+		}
+		// img holds the sum of the per-iteration estimates, like the other modes
+		img[p] = px.direct + px.tau / (M_PI * px.radius * px.radius * this->nPhoton);
+	}
+}
+
+// Gamma correct img * scale into image, colors brighter than 1 are scaled down to keep their hue.
+// Each column is first corrected as a flat float array so the pow loop can be vectorized
+void PhotonMapping::ToneMap(const std::vector<Vector3f>& img, float scale, float gamma, Image& image)
+{
+	static_assert(sizeof(Vector3f) == 3 * sizeof(float), "Vector3f is expected to be three packed floats");
+	int Width = image.Width(), Height = image.Height();
+	float exponent = 1.0f / gamma;
+	#pragma omp parallel
+	{
+		std::vector<float> column(3 * Height);
+		#pragma omp for
+		for (int i = 0; i < Width; i++)
+		{
+			const float* src = img[i * Height];
+			float* dst = column.data();
+			#pragma omp simd
+			for (int k = 0; k < 3 * Height; k++)
+				dst[k] = std::pow(src[k] * scale, exponent);
+			for (int j = 0; j < Height; j++)
+			{
+				float max_col = std::max(1.0f, std::max(dst[3 * j], std::max(dst[3 * j + 1], dst[3 * j + 2])));
+				image.SetPixel(i, j, Vector3f(dst[3 * j], dst[3 * j + 1], dst[3 * j + 2]) / max_col);
+			}
+		}
+	}
 }
 
 void PhotonMapping::Render(SceneParser& scene, Image& image)
@@ -152,64 +635,94 @@ void PhotonMapping::Render(SceneParser& scene, Image& image)
 	{
 		rng_list[i].SetSeed(rng_list[i].GetSeed() + rng_list[i].GetUniformInt(0, rng_list.size()) + i * rng_list.size());
 	}
+	SnapshotWriter snapshots(image.Width(), image.Height(), this->SnapshotInterval, this->SnapshotPeriod);
+
+	if (this->AdaptiveRadius)
+		this->Radii.assign(img.size(), PixelRadius{this->SearchRadius, 0.0f});
+	if (this->SPPM)
+		this->Pixels.assign(img.size(), SPPMPixel{this->SearchRadius, 0.0f, 0, Vector3f::ZERO, {0.0f, 0.0f, 0.0f}, Vector3f::ZERO});
+
+	// In pipelined mode the next pass is traced on its own thread team with separate random generators,
+	// threads are split between the two stages by the thread-seconds each took in the last iteration
+	int nThreads = omp_get_max_threads();
+	bool pipeline = this->Pipeline && !this->SPPM && nThreads > 1;
+	std::vector<RandomGenerator> trace_rng_list(pipeline? nThreads : 0);
+	for (size_t i = 0; i < trace_rng_list.size(); i++)
+	{
+		trace_rng_list[i].SetSeed(trace_rng_list[i].GetSeed() + (i + 1) * 7919 + rng_list.size());
+	}
+	std::thread builder;
+	double BuildWork = 0.0, GatherWork = 0.0;
 
 	for (int iteration = 0; iteration < this->iter; iteration++)
 	{
 		logging::INFO("Iteration " + std::to_string(iteration));
-		logging::INFO("Begin building PM");
-		this->BuildPM(scene, rng_list);
-		logging::INFO("Finish building PM");
-		int count = 0;
-		Image image_tmp(image.Width(), image.Height()); 
-		#pragma omp parallel for collapse(2) schedule(dynamic, 5)
-		for (int i = 0; i < image.Width(); i++)
-		{
-			for (int j = 0; j < image.Height(); j++)
+		if (this->SPPM)
+			this->IterateSPPM(scene, rng_list, img, image.Width(), image.Height());
+		else
+		{
+			if (builder.joinable())
 			{
-				RandomGenerator& rng = rng_list[omp_get_thread_num()];
-				Vector3f col = Vector3f::ZERO;
-				for (int k = 0; k < this->nRays; k++)
-				{
-					Ray camRay = scene.getCamera()->SampleRay(i, j, rng);
-					Vector3f co = GetRadiance(camRay, scene, rng);
-					if (!CheckValid(co))
-						continue;
-					col += co;
-				}
-				img[j + i * image.Height()] += col / this->nRays;
-				Vector3f col_tmp = img[j + i * image.Height()] / (iteration + 1);
-				float max_col = 1.0f;
-				for (int ii = 0; ii < 3; ii++)
-				{
-					col_tmp[ii] = std::pow(col_tmp[ii], 1.0f / scene.getCamera()->getGamma());
-					max_col = std::max(max_col, col_tmp[ii]);
-				}
-				image_tmp.SetPixel(i, j, col_tmp / max_col);
-				#pragma omp critical
-				{
-					count++;
-					if (!(count % 10000))
-						logging::INFO(std::to_string(count) + "/" + std::to_string(image.Width() * image.Height()) + " pixels finished\033[F");
-				}
+				builder.join();
+				std::swap(this->GlobalPM, this->NextPM);
+				logging::INFO("Photon map of the pass built in background");
+			}
+			else
+			{
+				logging::INFO("Begin building PM");
+				double BuildStart = omp_get_wtime();
+				this->BuildPM(scene, rng_list, this->GlobalPM, this->SearchRadius);
+				BuildWork = (omp_get_wtime() - BuildStart) * nThreads;
+				logging::INFO("Finish building PM");
 			}
-		}
-		image_tmp.SaveBMP(("tmp/" + std::to_string(iteration) + ".bmp").c_str());
-		this->SearchRadius *= std::sqrt((iteration + this->alpha) / (iteration + 1));
-		logging::INFO("Iteration " + std::to_string(iteration) + " finished                                  ");
-	}
 
-	for (int i = 0; i < image.Width(); i++)
-	{
-		for (int j = 0; j < image.Height(); j++)
-		{
-			Vector3f col = img[j + i * image.Height()] / this->iter;
-			float max_col = 1.0f;
-			for (int ii = 0; ii < 3; ii++)
+			int GatherThreads = nThreads;
+			if (pipeline && iteration + 1 < this->iter)
 			{
-				col[ii] = std::pow(col[ii], 1.0f / scene.getCamera()->getGamma());
-				max_col = std::max(max_col, col[ii]);
+				int BuildThreads = nThreads / 2;
+				if (GatherWork > 0.0)
+					BuildThreads = (int)std::lround(nThreads * BuildWork / (BuildWork + GatherWork));
+				BuildThreads = std::min(std::max(BuildThreads, 1), nThreads - 1);
+				GatherThreads = nThreads - BuildThreads;
+				// Pixel radii only shrink, so the current largest one bounds the grid cells of the next pass
+				float NextRadius = this->AdaptiveRadius? this->SearchRadius : this->SearchRadius * std::sqrt((iteration + this->alpha) / (iteration + 1));
+				logging::INFO("Building the next PM on " + std::to_string(BuildThreads) + " threads, gathering on " + std::to_string(GatherThreads));
+				builder = std::thread([this, &scene, &trace_rng_list, &BuildWork, BuildThreads, NextRadius]() {
+					omp_set_num_threads(BuildThreads);
+					double BuildStart = omp_get_wtime();
+					this->BuildPM(scene, trace_rng_list, this->NextPM, NextRadius);
+					BuildWork = (omp_get_wtime() - BuildStart) * BuildThreads;
+				});
 			}
-			image.SetPixel(i, j, col / max_col);
+
+			omp_set_num_threads(GatherThreads);
+			double GatherStart = omp_get_wtime();
+			if (this->BatchGather || this->Wavefront)
+				this->GatherBatched(scene, rng_list, img, image.Width(), image.Height());
+			else
+				this->GatherPixels(scene, rng_list, img, image.Width(), image.Height());
+			GatherWork = (omp_get_wtime() - GatherStart) * GatherThreads;
+			omp_set_num_threads(nThreads);
+			logging::INFO("Gathering finished in " + std::to_string((omp_get_wtime() - GatherStart) * 1000) + " ms                    ");
 		}
+		if (snapshots.Due(iteration, this->iter))
+		{
+			this->ToneMap(img, 1.0f / (iteration + 1), scene.getCamera()->getGamma(), snapshots.GetBuffer());
+			// The last snapshot waits for the writer rather than being dropped
+			if (!snapshots.Submit("tmp/" + std::to_string(iteration) + ".bmp", iteration + 1 == this->iter))
+				logging::INFO("Snapshot of iteration " + std::to_string(iteration) + " dropped, the last one is still being written");
+		}
+		if (this->AdaptiveRadius)
+		{
+			// SearchRadius follows the largest pixel radius, it sets the hash grid cell size
+			this->SearchRadius = 0.0f;
+			for (const PixelRadius& px : this->Radii)
+				this->SearchRadius = std::max(this->SearchRadius, px.radius);
+		}
+		else
+			this->SearchRadius *= std::sqrt((iteration + this->alpha) / (iteration + 1));
+		logging::INFO("Iteration " + std::to_string(iteration) + " finished                                  ");
 	}
+
+	this->ToneMap(img, 1.0f / this->iter, scene.getCamera()->getGamma(), image);
 }
\ No newline at end of file
@@ -17,7 +17,7 @@
 
 #define DegreesToRadians(x) ((M_PI * x) / 180.0f)
 
-SceneParser::SceneParser(const char *filename)
+SceneParser::SceneParser(const char *filename, MeshAccel accel, bool QuantizeMeshes) : accel(accel), QuantizeMeshes(QuantizeMeshes)
 {
 
 	// initialize some reasonable default values
@@ -49,6 +49,7 @@ SceneParser::SceneParser(const char *filename)
 	parseFile();
 	fclose(file);
 	file = nullptr;
+	addEmitters();
 
 	if (num_lights == 0)
 	{
@@ -120,6 +121,75 @@ void SceneParser::parseFile()
 	}
 }
 
+// Put the geometry of the area lights into the scene group, one Emitter for each object of a
+// light so that every panel gets its own box in the group BVH
+void SceneParser::addEmitters()
+{
+	if (group == nullptr)
+	{
+		group = new Group();
+		groups.push_back(group);
+	}
+	int count = 0;
+	for (int i = 0; i < num_lights; i++)
+	{
+		Object3D *object = lights[i]->GetObject();
+		if (object == nullptr)
+			continue;
+		Group *parts = dynamic_cast<Group *>(object);
+		if (parts == nullptr)
+		{
+			group->addObject(0, new Emitter(object, i));
+			count++;
+			continue;
+		}
+		for (Object3D *part : parts->getObjects())
+		{
+			group->addObject(0, new Emitter(part, i));
+			count++;
+		}
+	}
+	group->Build();
+	logging::INFO(std::to_string(count) + " emitters added to the scene, " + std::to_string(group->getNumUnbounded()) + " unbounded objects");
+}
+
+bool SceneParser::SetFrame(int frame, bool rebuild)
+{
+	if (AnimatedTransforms.empty() && AnimatedMeshes.empty())
+		return false;
+	for (AnimatedTransform &animated : AnimatedTransforms)
+	{
+		Matrix4f matrix = animated.matrix;
+		for (int i = 0; i < frame; i++)
+			matrix = matrix * animated.motion;
+		animated.transform->SetMatrix(matrix);
+	}
+
+	std::vector<Vector3f> positions, normals;
+	for (AnimatedMesh &animated : AnimatedMeshes)
+	{
+		std::string path = animated.frames;
+		size_t begin = path.find('#');
+		if (begin != std::string::npos)
+		{
+			size_t end = path.find_first_not_of('#', begin);
+			size_t width = ((end == std::string::npos)? path.size() : end) - begin;
+			std::string number = std::to_string(frame);
+			if (number.size() < width)
+				number.insert(0, width - number.size(), '0');
+			path.replace(begin, width, number);
+		}
+		// A missing frame keeps the last pose
+		if (MeshData::ReadVertices(path.c_str(), positions, normals))
+			animated.data->Deform(positions, normals, rebuild);
+	}
+
+	// Nested groups come first, so the boxes of inner groups are current when their parents use them
+	for (Group *g : groups)
+		g->Update(rebuild);
+	return true;
+}
+
 // ====================================================================
 // ====================================================================
 
@@ -673,6 +743,8 @@ Group *SceneParser::parseGroup()
 	}
 	getToken(token);
 	assert(!strcmp(token, "}"));
+	answer->Build();
+	groups.push_back(answer);
 
 	// return the group
 	return answer;
@@ -780,10 +852,30 @@ Mesh *SceneParser::parseTriangleMesh()
 	assert(!strcmp(token, "obj_file"));
 	getToken(filename);
 	getToken(token);
+	std::string frames;
+	if (!strcmp(token, "vertex_frames"))
+	{
+		getToken(token);
+		frames = token;
+		getToken(token);
+	}
 	assert(!strcmp(token, "}"));
 	const char *ext = &filename[strlen(filename) - 4];
 	assert(!strcmp(ext, ".obj"));
-	Mesh *answer = new Mesh(filename, current_material);
+	if (!frames.empty())
+	{
+		// Deformed every frame, so the geometry is not shared with other placements
+		auto data = std::make_shared<MeshData>(filename, accel, QuantizeMeshes, true);
+		AnimatedMeshes.push_back({data, frames});
+		return new Mesh(data, current_material);
+	}
+	// Every placement of the same file shares one loaded mesh and its BVH
+	auto it = meshes.find(filename);
+	if (it == meshes.end())
+		it = meshes.emplace(filename, std::make_shared<const MeshData>(filename, accel, QuantizeMeshes)).first;
+	else
+		logging::INFO("Instancing " + std::string(filename) + ", " + std::to_string(it->second->GetNumTriangles()) + " triangles shared");
+	Mesh *answer = new Mesh(it->second, current_material);
 
 	return answer;
 }
@@ -792,6 +884,8 @@ Transform *SceneParser::parseTransform()
 {
 	char token[MAX_PARSER_TOKEN_LENGTH];
 	Matrix4f matrix = Matrix4f::identity();
+	Matrix4f motion = Matrix4f::identity();
+	bool animated = false;
 	Object3D *object = nullptr;
 	getToken(token);
 	assert(!strcmp(token, "{"));
@@ -802,61 +896,24 @@ Transform *SceneParser::parseTransform()
 
 	while (true)
 	{
-		if (!strcmp(token, "Scale"))
-		{
-			Vector3f s = readVector3f();
-			matrix = matrix * Matrix4f::scaling(s[0], s[1], s[2]);
-		}
-		else if (!strcmp(token, "UniformScale"))
-		{
-			float s = readFloat();
-			matrix = matrix * Matrix4f::uniformScaling(s);
-		}
-		else if (!strcmp(token, "Translate"))
-		{
-			matrix = matrix * Matrix4f::translation(readVector3f());
-		}
-		else if (!strcmp(token, "XRotate"))
-		{
-			matrix = matrix * Matrix4f::rotateX(DegreesToRadians(readFloat()));
-		}
-		else if (!strcmp(token, "YRotate"))
-		{
-			matrix = matrix * Matrix4f::rotateY(DegreesToRadians(readFloat()));
-		}
-		else if (!strcmp(token, "ZRotate"))
-		{
-			matrix = matrix * Matrix4f::rotateZ(DegreesToRadians(readFloat()));
-		}
-		else if (!strcmp(token, "Rotate"))
+		if (!strcmp(token, "Motion"))
 		{
+			// Transformations applied once more every frame, before all others
 			getToken(token);
 			assert(!strcmp(token, "{"));
-			Vector3f axis = readVector3f();
-			float degrees = readFloat();
-			float radians = DegreesToRadians(degrees);
-			matrix = matrix * Matrix4f::rotation(axis, radians);
-			getToken(token);
-			assert(!strcmp(token, "}"));
-		}
-		else if (!strcmp(token, "Matrix4f"))
-		{
-			Matrix4f matrix2 = Matrix4f::identity();
 			getToken(token);
-			assert(!strcmp(token, "{"));
-			for (int j = 0; j < 4; j++)
+			while (strcmp(token, "}"))
 			{
-				for (int i = 0; i < 4; i++)
+				if (!parseTransformation(token, motion))
 				{
-					float v = readFloat();
-					matrix2(i, j) = v;
+					printf("Unknown token in Motion: '%s'\n", token);
+					exit(0);
 				}
+				getToken(token);
 			}
-			getToken(token);
-			assert(!strcmp(token, "}"));
-			matrix = matrix2 * matrix;
+			animated = true;
 		}
-		else
+		else if (!parseTransformation(token, matrix))
 		{
 			// otherwise this must be an object,
 			// and there are no more transformations
@@ -869,7 +926,74 @@ Transform *SceneParser::parseTransform()
 	assert(object != nullptr);
 	getToken(token);
 	assert(!strcmp(token, "}"));
-	return new Transform(matrix, object);
+	Transform *answer = new Transform(matrix, object);
+	if (animated)
+		AnimatedTransforms.push_back({answer, matrix, motion});
+	return answer;
+}
+
+// Append one transformation on the object side of matrix (matrix = matrix * T), so later ones in a
+// Transform or Motion block act first on the object. A Matrix4f is the exception and is multiplied
+// on the left. Returns false when token is not a transformation
+bool SceneParser::parseTransformation(char token[MAX_PARSER_TOKEN_LENGTH], Matrix4f &matrix)
+{
+	if (!strcmp(token, "Scale"))
+	{
+		Vector3f s = readVector3f();
+		matrix = matrix * Matrix4f::scaling(s[0], s[1], s[2]);
+	}
+	else if (!strcmp(token, "UniformScale"))
+	{
+		float s = readFloat();
+		matrix = matrix * Matrix4f::uniformScaling(s);
+	}
+	else if (!strcmp(token, "Translate"))
+	{
+		matrix = matrix * Matrix4f::translation(readVector3f());
+	}
+	else if (!strcmp(token, "XRotate"))
+	{
+		matrix = matrix * Matrix4f::rotateX(DegreesToRadians(readFloat()));
+	}
+	else if (!strcmp(token, "YRotate"))
+	{
+		matrix = matrix * Matrix4f::rotateY(DegreesToRadians(readFloat()));
+	}
+	else if (!strcmp(token, "ZRotate"))
+	{
+		matrix = matrix * Matrix4f::rotateZ(DegreesToRadians(readFloat()));
+	}
+	else if (!strcmp(token, "Rotate"))
+	{
+		getToken(token);
+		assert(!strcmp(token, "{"));
+		Vector3f axis = readVector3f();
+		float degrees = readFloat();
+		float radians = DegreesToRadians(degrees);
+		matrix = matrix * Matrix4f::rotation(axis, radians);
+		getToken(token);
+		assert(!strcmp(token, "}"));
+	}
+	else if (!strcmp(token, "Matrix4f"))
+	{
+		Matrix4f matrix2 = Matrix4f::identity();
+		getToken(token);
+		assert(!strcmp(token, "{"));
+		for (int j = 0; j < 4; j++)
+		{
+			for (int i = 0; i < 4; i++)
+			{
+				float v = readFloat();
+				matrix2(i, j) = v;
+			}
+		}
+		getToken(token);
+		assert(!strcmp(token, "}"));
+		matrix = matrix2 * matrix;
+	}
+	else
+		return false;
+	return true;
 }
 
 // ====================================================================
@@ -62,4 +62,20 @@ Vector3f Refract(const Vector3f& v, const Vector3f& n, float ior1, float ior2)
 bool CheckValid(const Vector3f& v)
 {
 	return !(std::isnan(v[0]) || std::isnan(v[1]) || std::isnan(v[2]) || v[0] < 0 || v[1] < 0 || v[2] < 0 || std::isinf(v[0]) || std::isinf(v[1]) || std::isinf(v[2]));
+}
+
+static uint64_t SpreadBits(uint64_t v)	// Insert two zero bits between each of the lower 21 bits
+{
+	v &= 0x1fffff;
+	v = (v | v << 32) & 0x1f00000000ffff;
+	v = (v | v << 16) & 0x1f0000ff0000ff;
+	v = (v | v << 8) & 0x100f00f00f00f00f;
+	v = (v | v << 4) & 0x10c30c30c30c30c3;
+	v = (v | v << 2) & 0x1249249249249249;
+	return v;
+}
+
+uint64_t MortonCode(unsigned x, unsigned y, unsigned z)
+{
+	return SpreadBits(x) | SpreadBits(y) << 1 | SpreadBits(z) << 2;
 }
\ No newline at end of file
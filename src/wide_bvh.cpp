@@ -0,0 +1,72 @@
+#include "wide_bvh.hpp"
+#include <cstring>
+
+#ifdef WIDE_BVH_X86
+#include <immintrin.h>
+#include "wide_bvh_kernel.hpp"
+
+namespace
+{
+
+// SSE2 is part of x86-64, this kernel runs on every CPU the renderer builds for
+struct SSELanes
+{
+	typedef __m128 V;
+	static const int W = 4;
+	static V Load(const float* p) { return _mm_loadu_ps(p); }
+	static V LoadBytes(const unsigned char* p)
+	{
+		int bytes;
+		std::memcpy(&bytes, p, sizeof(bytes));
+		__m128i zero = _mm_setzero_si128();
+		return _mm_cvtepi32_ps(_mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(bytes), zero), zero));
+	}
+	static void Store(float* p, V a) { _mm_store_ps(p, a); }
+	static V Set(float x) { return _mm_set1_ps(x); }
+	static V Add(V a, V b) { return _mm_add_ps(a, b); }
+	static V Sub(V a, V b) { return _mm_sub_ps(a, b); }
+	static V Mul(V a, V b) { return _mm_mul_ps(a, b); }
+	static V Div(V a, V b) { return _mm_div_ps(a, b); }
+	static V Min(V a, V b) { return _mm_min_ps(a, b); }
+	static V Max(V a, V b) { return _mm_max_ps(a, b); }
+	static V Abs(V a) { return _mm_andnot_ps(_mm_set1_ps(-0.0f), a); }
+	static V And(V a, V b) { return _mm_and_ps(a, b); }
+	static V Lt(V a, V b) { return _mm_cmplt_ps(a, b); }
+	static V Le(V a, V b) { return _mm_cmple_ps(a, b); }
+	static V Ge(V a, V b) { return _mm_cmpge_ps(a, b); }
+	static unsigned Mask(V a) { return _mm_movemask_ps(a); }
+};
+
+}
+
+bool IntersectWide4(const WideNode<4>* nodes, const TriangleView& tri, WideRay& ray, WideHit& hit)
+{
+	return wide::Intersect<SSELanes>(nodes, tri, ray, hit);
+}
+
+bool IntersectWide4(const QuantizedWideNode<4>* nodes, const TriangleView& tri, WideRay& ray, WideHit& hit)
+{
+	return wide::Intersect<SSELanes>(nodes, tri, ray, hit);
+}
+#endif
+
+bool CpuHasAVX2()
+{
+#if defined(WIDE_BVH_X86) && defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return false;
+	__cpuid(info, 1);
+	bool osxsave = info[2] & (1 << 27), avx = info[2] & (1 << 28);
+	if (!osxsave || !avx || (_xgetbv(0) & 6) != 6)	// The OS has to save the YMM registers
+		return false;
+	__cpuidex(info, 7, 0);
+	return info[1] & (1 << 5);
+#elif defined(WIDE_BVH_X86)
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+#else
+	return false;
+#endif
+}
@@ -0,0 +1,47 @@
+// Built with AVX2 enabled (see CMakeLists.txt), only called after CpuHasAVX2()
+#include "wide_bvh.hpp"
+
+#ifdef WIDE_BVH_X86
+#ifndef __AVX2__
+#error "wide_bvh_avx2.cpp has to be compiled with AVX2 enabled"
+#endif
+#include <immintrin.h>
+#include "wide_bvh_kernel.hpp"
+
+namespace
+{
+
+struct AVX2Lanes
+{
+	typedef __m256 V;
+	static const int W = 8;
+	static V Load(const float* p) { return _mm256_loadu_ps(p); }
+	static V LoadBytes(const unsigned char* p) { return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i*)p))); }
+	static void Store(float* p, V a) { _mm256_store_ps(p, a); }
+	static V Set(float x) { return _mm256_set1_ps(x); }
+	static V Add(V a, V b) { return _mm256_add_ps(a, b); }
+	static V Sub(V a, V b) { return _mm256_sub_ps(a, b); }
+	static V Mul(V a, V b) { return _mm256_mul_ps(a, b); }
+	static V Div(V a, V b) { return _mm256_div_ps(a, b); }
+	static V Min(V a, V b) { return _mm256_min_ps(a, b); }
+	static V Max(V a, V b) { return _mm256_max_ps(a, b); }
+	static V Abs(V a) { return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a); }
+	static V And(V a, V b) { return _mm256_and_ps(a, b); }
+	static V Lt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	static V Le(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LE_OQ); }
+	static V Ge(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_GE_OQ); }
+	static unsigned Mask(V a) { return _mm256_movemask_ps(a); }
+};
+
+}
+
+bool IntersectWide8(const WideNode<8>* nodes, const TriangleView& tri, WideRay& ray, WideHit& hit)
+{
+	return wide::Intersect<AVX2Lanes>(nodes, tri, ray, hit);
+}
+
+bool IntersectWide8(const QuantizedWideNode<8>* nodes, const TriangleView& tri, WideRay& ray, WideHit& hit)
+{
+	return wide::Intersect<AVX2Lanes>(nodes, tri, ray, hit);
+}
+#endif